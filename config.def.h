@@ -15,6 +15,10 @@ static const char *colors[SchemeLast][2] = {
 };
 /* -l option; if nonzero, dmenu uses vertical list with given number of lines */
 static unsigned int lines      = 0;
+/* -P option; width of the menu drawn into an image */
+static unsigned int headlessw  = 1280;
+/* KiB of rendered item rows kept to scroll by copying, 0 to keep none */
+static unsigned int rowcache   = 4096;
 
 /*
  * Characters not considered part of a word while deleting words
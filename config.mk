@@ -10,7 +10,7 @@ SWCPROTO = /usr/share/swc/swc.xml
 
 # includes and libs
 INCS = -I${PIXMANINC}
-LIBS = -lwayland-client -lxkbcommon -lwld -lfontconfig
+LIBS = -lwayland-client -lxkbcommon -lwld -lpixman-1 -lfontconfig -lpthread
 
 # flags
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"${VERSION}\"
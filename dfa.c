@@ -0,0 +1,779 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "util.h"
+
+#define DFAMAX   4096 /* states cached before the cache is flushed */
+#define HASHSIZE (2 * DFAMAX)
+
+enum { ReByte, ReSplit, ReJump, ReBol, ReEol, ReMatch }; /* node ops */
+enum { AtStart = 1, AtEnd = 2 }; /* where an assertion may pass */
+
+typedef struct {
+	size_t off, len; /* in the buffer of the Regex */
+	int ok;
+} Lit;
+
+/* A piece of the NFA: its first node, a list of the outs left to patch
+ * through the outs themselves, the text it matches exactly if ok, texts
+ * every match of it starts and ends with, and the longest text every match
+ * of it holds */
+typedef struct {
+	int start, out;
+	Lit exact, pre, suf, req;
+} Frag;
+
+typedef struct {
+	Regex *re;
+	const unsigned char *s, *end;
+	int err;
+} Parser;
+
+static Frag parsealt(Parser *p);
+
+static size_t
+utf8dec(const unsigned char *s, size_t len, long *u)
+{
+	size_t i, n;
+
+	if (BETWEEN(*s, 0xC2, 0xDF))
+		n = 2;
+	else if (BETWEEN(*s, 0xE0, 0xEF))
+		n = 3;
+	else if (BETWEEN(*s, 0xF0, 0xF4))
+		n = 4;
+	else
+		return 0;
+	if (n > len)
+		return 0;
+	for (*u = *s & (0x7F >> n), i = 1; i < n; i++) {
+		if ((s[i] & 0xC0) != 0x80)
+			return 0;
+		*u = (*u << 6) | (s[i] & 0x3F);
+	}
+	if ((n == 3 && *u < 0x800) || (n == 4 && (*u < 0x10000 || *u > 0x10FFFF)) ||
+	    BETWEEN(*u, 0xD800, 0xDFFF))
+		return 0;
+	return n;
+}
+
+static size_t
+utf8enc(unsigned char *d, long u)
+{
+	if (u < 0x80) {
+		d[0] = u;
+		return 1;
+	} else if (u < 0x800) {
+		d[0] = 0xC0 | u >> 6;
+		d[1] = 0x80 | (u & 0x3F);
+		return 2;
+	} else if (u < 0x10000) {
+		d[0] = 0xE0 | u >> 12;
+		d[1] = 0x80 | (u >> 6 & 0x3F);
+		d[2] = 0x80 | (u & 0x3F);
+		return 3;
+	}
+	d[0] = 0xF0 | u >> 18;
+	d[1] = 0x80 | (u >> 12 & 0x3F);
+	d[2] = 0x80 | (u >> 6 & 0x3F);
+	d[3] = 0x80 | (u & 0x3F);
+	return 4;
+}
+
+static int
+newnode(Regex *re, int op, int lo, int hi, int out, int out1)
+{
+	ReNode *n;
+
+	if (re->nnode == re->nodesize) {
+		re->nodesize = re->nodesize ? 2 * re->nodesize : 64;
+		if (!(re->node = realloc(re->node, re->nodesize * sizeof *re->node)))
+			die("cannot realloc %zu bytes:", re->nodesize * sizeof *re->node);
+	}
+	n = &re->node[re->nnode];
+	n->op = op;
+	n->lo = lo;
+	n->hi = hi;
+	n->out = out;
+	n->out1 = out1;
+	return re->nnode++;
+}
+
+/* point every out on the list l at node */
+static void
+patch(Regex *re, int l, int node)
+{
+	int *p;
+
+	for (; l >= 0; l = *p, *p = node)
+		p = l & 1 ? &re->node[l >> 1].out1 : &re->node[l >> 1].out;
+}
+
+static int
+append(Regex *re, int l1, int l2)
+{
+	int l, *p;
+
+	if (l1 < 0)
+		return l2;
+	for (l = l1; *(p = l & 1 ? &re->node[l >> 1].out1 : &re->node[l >> 1].out) >= 0; l = *p)
+		;
+	*p = l2;
+	return l1;
+}
+
+/* add a node reading a byte in [lo, hi] after the node prev */
+static int
+chain(Regex *re, int prev, int lo, int hi)
+{
+	int n = newnode(re, ReByte, lo, hi, -1, -1);
+
+	re->node[prev].out = n;
+	return n;
+}
+
+/* copy the texts a and b, one after the other, to the buffer */
+static Lit
+litcat(Regex *re, Lit a, Lit b)
+{
+	Lit l = { re->buflen, a.len + b.len, 1 };
+
+	if (!l.len)
+		return l;
+	if (re->buflen + l.len > re->bufsize) {
+		re->bufsize = MAX(2 * re->bufsize, re->buflen + l.len);
+		if (!(re->buf = realloc(re->buf, re->bufsize)))
+			die("cannot realloc %zu bytes:", re->bufsize);
+	}
+	memmove(re->buf + re->buflen, re->buf + a.off, a.len);
+	memmove(re->buf + re->buflen + a.len, re->buf + b.off, b.len);
+	re->buflen += l.len;
+	return l;
+}
+
+static Frag
+frag(int start, int out)
+{
+	Frag f;
+
+	f.start = start;
+	f.out = out;
+	f.exact.off = f.exact.len = f.exact.ok = 0;
+	f.pre = f.suf = f.req = f.exact;
+	return f;
+}
+
+/* a node passing without input, matching the empty text */
+static Frag
+empty(Regex *re, int op)
+{
+	int n = newnode(re, op, 0, 0, -1, -1);
+	Frag f = frag(n, n << 1);
+
+	f.exact.ok = 1;
+	return f;
+}
+
+static Frag
+cat(Regex *re, Frag a, Frag b)
+{
+	Frag f = frag(a.start, b.out);
+	Lit mid;
+
+	patch(re, a.out, b.start);
+	if (a.exact.ok && b.exact.ok) {
+		f.exact = f.pre = f.suf = f.req = litcat(re, a.exact, b.exact);
+		return f;
+	}
+	f.pre = a.exact.ok ? litcat(re, a.exact, b.pre) : a.pre;
+	f.suf = b.exact.ok ? litcat(re, a.suf, b.exact) : b.suf;
+	mid = litcat(re, a.suf, b.pre);
+	f.req = a.req.len >= b.req.len ? a.req : b.req;
+	if (mid.len > f.req.len)
+		f.req = mid;
+	if (f.pre.len > f.req.len)
+		f.req = f.pre;
+	if (f.suf.len > f.req.len)
+		f.req = f.suf;
+	return f;
+}
+
+static Frag
+alt(Regex *re, Frag a, Frag b)
+{
+	int n = newnode(re, ReSplit, 0, 0, a.start, b.start);
+
+	return frag(n, append(re, a.out, b.out));
+}
+
+/* the bytes s[0..n) in sequence */
+static Frag
+literal(Regex *re, const unsigned char *s, size_t n)
+{
+	Frag f;
+	size_t i;
+	int node;
+
+	f = frag(newnode(re, ReByte, s[0], s[0], -1, -1), 0);
+	for (node = f.start, i = 1; i < n; i++)
+		node = chain(re, node, s[i], s[i]);
+	f.out = node << 1;
+	if (re->buflen + n > re->bufsize) {
+		re->bufsize = MAX(2 * re->bufsize, re->buflen + n);
+		if (!(re->buf = realloc(re->buf, re->bufsize)))
+			die("cannot realloc %zu bytes:", re->bufsize);
+	}
+	memcpy(re->buf + re->buflen, s, n);
+	f.exact.off = re->buflen;
+	f.exact.len = n;
+	f.exact.ok = 1;
+	f.pre = f.suf = f.req = f.exact;
+	re->buflen += n;
+	return f;
+}
+
+/* add the UTF-8 encodings of the code points [lo, hi] as alternatives to
+ * f, as sequences of byte ranges */
+static void
+utf8range(Regex *re, Frag *f, long lo, long hi)
+{
+	static const long bound[] = { 0x7F, 0x7FF, 0xFFFF };
+	unsigned char a[4], b[4];
+	Frag s;
+	size_t i, n;
+	long m;
+	int node;
+
+	if (lo <= 0xDFFF && hi >= 0xD800) {
+		/* surrogates have no encoding */
+		if (lo < 0xD800)
+			utf8range(re, f, lo, 0xD7FF);
+		if (hi > 0xDFFF)
+			utf8range(re, f, 0xE000, hi);
+		return;
+	}
+	/* split the range until the code points in it are all as long, and
+	 * every byte of them ranges independently of the others */
+	for (i = 0; i < sizeof bound / sizeof *bound; i++) {
+		if (lo <= bound[i] && hi > bound[i]) {
+			utf8range(re, f, lo, bound[i]);
+			utf8range(re, f, bound[i] + 1, hi);
+			return;
+		}
+	}
+	for (i = 1; hi > 0x7F && i < 4; i++) {
+		m = (1L << (6 * i)) - 1;
+		if ((lo & ~m) == (hi & ~m))
+			continue;
+		if (lo & m) {
+			utf8range(re, f, lo, lo | m);
+			utf8range(re, f, (lo | m) + 1, hi);
+			return;
+		}
+		if ((hi & m) != m) {
+			utf8range(re, f, lo, (hi & ~m) - 1);
+			utf8range(re, f, hi & ~m, hi);
+			return;
+		}
+	}
+	n = utf8enc(a, lo);
+	utf8enc(b, hi);
+	s = frag(newnode(re, ReByte, a[0], b[0], -1, -1), 0);
+	for (node = s.start, i = 1; i < n; i++)
+		node = chain(re, node, a[i], b[i]);
+	s.out = node << 1;
+	*f = f->start < 0 ? s : alt(re, *f, s);
+}
+
+static int
+rangecmp(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+addrange(Regex *re, long lo, long hi)
+{
+	if (re->nranges + 2 > re->rangesize) {
+		re->rangesize = re->rangesize ? 2 * re->rangesize : 32;
+		if (!(re->ranges = realloc(re->ranges, re->rangesize * sizeof *re->ranges)))
+			die("cannot realloc %zu bytes:", re->rangesize * sizeof *re->ranges);
+	}
+	re->ranges[re->nranges++] = lo;
+	re->ranges[re->nranges++] = hi;
+}
+
+/* the code points in the ranges, or all others if neg */
+static Frag
+class(Regex *re, int neg)
+{
+	Frag f = frag(-1, -1);
+	size_t i, n = 0;
+	long lo = 0;
+
+	if (re->nranges)
+		qsort(re->ranges, re->nranges / 2, 2 * sizeof *re->ranges, rangecmp);
+	for (i = 0; i < re->nranges; i += 2) {
+		if (n && re->ranges[i] <= re->ranges[n - 1] + 1) {
+			re->ranges[n - 1] = MAX(re->ranges[n - 1], re->ranges[i + 1]);
+		} else {
+			re->ranges[n++] = re->ranges[i];
+			re->ranges[n++] = re->ranges[i + 1];
+		}
+	}
+	for (i = 0; i < n; i += 2) {
+		if (!neg)
+			utf8range(re, &f, re->ranges[i], re->ranges[i + 1]);
+		else if (lo < re->ranges[i])
+			utf8range(re, &f, lo, re->ranges[i] - 1);
+		lo = re->ranges[i + 1] + 1;
+	}
+	if (neg && lo <= 0x10FFFF)
+		utf8range(re, &f, lo, 0x10FFFF);
+	if (f.start < 0) /* matches nothing */
+		f = frag(newnode(re, ReByte, 1, 0, -1, -1), 0);
+	return f;
+}
+
+/* read a character of a bracket expression, escaped or not */
+static long
+classchar(Parser *p)
+{
+	size_t n;
+	long u;
+
+	if (p->s < p->end && *p->s == '\\')
+		p->s++;
+	if (p->s == p->end) {
+		p->err = 1;
+		return 0;
+	}
+	if (*p->s < 0x80)
+		return *p->s++;
+	if (!(n = utf8dec(p->s, p->end - p->s, &u))) {
+		p->err = 1;
+		return 0;
+	}
+	p->s += n;
+	return u;
+}
+
+/* add the ASCII ranges of a character class like "[:alpha:]" at s, return
+ * its length or 0 if there is none */
+static size_t
+namedclass(Regex *re, const unsigned char *s, const unsigned char *end)
+{
+	static const struct {
+		const char *name;
+		const char *ranges; /* pairs of bounds */
+	} classes[] = {
+		{ "[:alnum:]",  "09AZaz" },
+		{ "[:alpha:]",  "AZaz" },
+		{ "[:blank:]",  "\t\t  " },
+		{ "[:cntrl:]",  "\x01\x1f\x7f\x7f" },
+		{ "[:digit:]",  "09" },
+		{ "[:graph:]",  "!~" },
+		{ "[:lower:]",  "az" },
+		{ "[:print:]",  " ~" },
+		{ "[:punct:]",  "!/:@[`{~" },
+		{ "[:space:]",  "\t\r  " },
+		{ "[:upper:]",  "AZ" },
+		{ "[:xdigit:]", "09AFaf" },
+	};
+	size_t i, j, n;
+
+	for (i = 0; i < sizeof classes / sizeof *classes; i++) {
+		n = strlen(classes[i].name);
+		if ((size_t)(end - s) < n || memcmp(s, classes[i].name, n))
+			continue;
+		for (j = 0; classes[i].ranges[j]; j += 2)
+			addrange(re, classes[i].ranges[j], classes[i].ranges[j + 1]);
+		return n;
+	}
+	return 0;
+}
+
+static Frag
+parseclass(Parser *p)
+{
+	size_t n;
+	long lo, hi;
+	int neg = 0, first = 1;
+
+	p->re->nranges = 0;
+	if (p->s < p->end && *p->s == '^') {
+		neg = 1;
+		p->s++;
+	}
+	while (!p->err) {
+		if (p->s == p->end) {
+			p->err = 1;
+			break;
+		}
+		if (*p->s == ']' && !first) {
+			p->s++;
+			break;
+		}
+		first = 0;
+		if ((n = namedclass(p->re, p->s, p->end))) {
+			p->s += n;
+			continue;
+		}
+		lo = hi = classchar(p);
+		if (p->end - p->s >= 2 && p->s[0] == '-' && p->s[1] != ']') {
+			p->s++;
+			if ((hi = classchar(p)) < lo)
+				p->err = 1;
+		}
+		addrange(p->re, lo, hi);
+	}
+	return class(p->re, neg);
+}
+
+static Frag
+parseatom(Parser *p)
+{
+	Frag f;
+	size_t n;
+	long u;
+	int c = *p->s++;
+
+	switch (c) {
+	case '(':
+		f = parsealt(p);
+		if (p->s == p->end || *p->s != ')')
+			p->err = 1;
+		else
+			p->s++;
+		return f;
+	case '[':
+		return parseclass(p);
+	case '.':
+		p->re->nranges = 0;
+		return class(p->re, 1);
+	case '^':
+		return empty(p->re, ReBol);
+	case '$':
+		return empty(p->re, ReEol);
+	case '*': case '+': case '?':
+		p->err = 1; /* repeats nothing */
+		return frag(-1, -1);
+	case '\\':
+		if (p->s == p->end) {
+			p->err = 1;
+			return frag(-1, -1);
+		}
+		c = *p->s++;
+		break;
+	}
+	/* a character, or a lone byte if it is not UTF-8 */
+	p->s--;
+	n = c < 0x80 ? 1 : MAX(utf8dec(p->s, p->end - p->s, &u), 1);
+	p->s += n;
+	return literal(p->re, p->s - n, n);
+}
+
+static Frag
+parserep(Parser *p)
+{
+	Frag f = parseatom(p);
+	int n;
+
+	while (!p->err && p->s < p->end && strchr("*+?", *p->s)) {
+		n = newnode(p->re, ReSplit, 0, 0, f.start, -1);
+		switch (*p->s++) {
+		case '*':
+			patch(p->re, f.out, n);
+			f = frag(n, n << 1 | 1);
+			break;
+		case '+':
+			patch(p->re, f.out, n);
+			f.out = n << 1 | 1;
+			f.exact.ok = 0; /* but still starts with f.pre and so on */
+			break;
+		case '?':
+			f = frag(n, append(p->re, f.out, n << 1 | 1));
+			break;
+		}
+	}
+	return f;
+}
+
+static Frag
+parsecat(Parser *p)
+{
+	Frag f;
+
+	if (p->s == p->end || *p->s == '|' || *p->s == ')')
+		return empty(p->re, ReJump);
+	for (f = parserep(p); !p->err && p->s < p->end && *p->s != '|' && *p->s != ')'; )
+		f = cat(p->re, f, parserep(p));
+	return f;
+}
+
+static Frag
+parsealt(Parser *p)
+{
+	Frag f = parsecat(p);
+
+	while (!p->err && p->s < p->end && *p->s == '|') {
+		p->s++;
+		f = alt(p->re, f, parsecat(p));
+	}
+	return f;
+}
+
+/* Compile the text s into re, return 0 if it is not a regular expression.
+ * It is an extended regular expression of characters, escaped with a
+ * backslash if special, bracket expressions with the ASCII character classes,
+ * '.', '^', '$', '*', '+', '?', '|' and parentheses, over UTF-8 characters. */
+int
+re_compile(Regex *re, const char *s, size_t len)
+{
+	Parser p;
+	Frag f;
+
+	re->gen++;
+	re->nnode = re->buflen = 0;
+	re->start = -1;
+	re->lit = NULL;
+	re->litlen = 0;
+	p.re = re;
+	p.s = (const unsigned char *)s;
+	p.end = p.s + len;
+	p.err = 0;
+	f = parsealt(&p);
+	if (p.err || p.s != p.end)
+		return 0;
+	patch(re, f.out, newnode(re, ReMatch, 0, 0, -1, -1));
+	re->start = f.start;
+	if (f.req.len) {
+		re->lit = re->buf + f.req.off;
+		re->litlen = f.req.len;
+	}
+	return 1;
+}
+
+static void
+flush(Dfa *d)
+{
+	d->nstate = d->npool = 0;
+	d->startstate = -1;
+	memset(d->hash, -1, HASHSIZE * sizeof *d->hash);
+}
+
+static void
+reset(Dfa *d, const Regex *re)
+{
+	size_t n = re->nnode;
+
+	if (!d->state) {
+		d->state = ecalloc(DFAMAX, sizeof *d->state);
+		d->hash = ecalloc(HASHSIZE, sizeof *d->hash);
+	}
+	if (!(d->stack = realloc(d->stack, (3 * n + 2) * sizeof *d->stack)) ||
+	    !(d->set = realloc(d->set, n * sizeof *d->set)) ||
+	    !(d->mark = realloc(d->mark, n * sizeof *d->mark)))
+		die("cannot realloc %zu bytes:", (3 * n + 2) * sizeof *d->stack);
+	memset(d->mark, 0, n * sizeof *d->mark);
+	d->markgen = 0;
+	d->re = re;
+	d->gen = re->gen;
+	flush(d);
+}
+
+static int
+intcmp(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* put the nodes reached from the n nodes on the stack without reading input
+ * in the set, in order, return how many there are */
+static size_t
+closure(Dfa *d, size_t n, int at)
+{
+	const ReNode *node;
+	size_t len = 0;
+	int i;
+
+	if (++d->markgen == 0) {
+		memset(d->mark, 0, d->re->nnode * sizeof *d->mark);
+		d->markgen = 1;
+	}
+	while (n > 0) {
+		if ((i = d->stack[--n]) < 0 || d->mark[i] == d->markgen)
+			continue;
+		d->mark[i] = d->markgen;
+		switch ((node = &d->re->node[i])->op) {
+		case ReSplit:
+			d->stack[n++] = node->out1;
+			/* fallthrough */
+		case ReJump:
+			d->stack[n++] = node->out;
+			break;
+		case ReBol:
+			if (at & AtStart)
+				d->stack[n++] = node->out;
+			break;
+		case ReEol:
+			if (at & AtEnd)
+				d->stack[n++] = node->out;
+			else
+				d->set[len++] = i; /* passed at the end */
+			break;
+		default:
+			d->set[len++] = i;
+			break;
+		}
+	}
+	qsort(d->set, len, sizeof *d->set, intcmp);
+	return len;
+}
+
+static int
+matches(const Dfa *d, const int *set, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (d->re->node[set[i]].op == ReMatch)
+			return 1;
+	return 0;
+}
+
+/* return the state of the first n nodes of the set, -1 if there is none
+ * yet and *slot to put it in */
+static int
+lookup(const Dfa *d, size_t n, size_t *slot)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+	int st;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ (uint32_t)d->set[i]) * 16777619;
+	for (i = h & (HASHSIZE - 1); (st = d->hash[i]) >= 0; i = (i + 1) & (HASHSIZE - 1))
+		if (d->state[st].n == n && !memcmp(d->pool + d->state[st].off, d->set, n * sizeof *d->set))
+			return st;
+	*slot = i;
+	return -1;
+}
+
+/* return the state of the first n nodes of the set, made if there is none,
+ * flushing the cache first when it is full */
+static int
+getstate(Dfa *d, size_t n, int *flushed)
+{
+	DfaState *s;
+	size_t slot;
+	int st;
+
+	if ((st = lookup(d, n, &slot)) >= 0)
+		return st;
+	if (d->nstate == DFAMAX) {
+		flush(d);
+		*flushed = 1;
+		lookup(d, n, &slot);
+	}
+	if (d->npool + n > d->poolsize) {
+		d->poolsize = MAX(2 * d->poolsize, d->npool + n);
+		if (!(d->pool = realloc(d->pool, d->poolsize * sizeof *d->pool)))
+			die("cannot realloc %zu bytes:", d->poolsize * sizeof *d->pool);
+	}
+	memcpy(d->pool + d->npool, d->set, n * sizeof *d->set);
+	s = &d->state[d->nstate];
+	s->off = d->npool;
+	s->n = n;
+	s->match = matches(d, d->set, n);
+	s->matchend = -1;
+	memset(s->next, -1, sizeof s->next);
+	d->npool += n;
+	d->hash[slot] = d->nstate;
+	return d->nstate++;
+}
+
+static int
+startstate(Dfa *d)
+{
+	int flushed = 0;
+
+	d->stack[0] = d->re->start;
+	return d->startstate = getstate(d, closure(d, 1, AtStart), &flushed);
+}
+
+/* return the state after reading the byte c in the state st */
+static int
+step(Dfa *d, int st, unsigned char c)
+{
+	const ReNode *node;
+	size_t i, n = 0;
+	int next, flushed = 0;
+
+	for (i = 0; i < d->state[st].n; i++) {
+		node = &d->re->node[d->pool[d->state[st].off + i]];
+		if (node->op == ReByte && BETWEEN(c, node->lo, node->hi))
+			d->stack[n++] = node->out;
+	}
+	d->stack[n++] = d->re->start; /* a match may start at any byte */
+	next = getstate(d, closure(d, n, 0), &flushed);
+	if (!flushed)
+		d->state[st].next[c] = next;
+	return next;
+}
+
+/* return whether a match ends at the end of the text in the state st */
+static int
+matchend(Dfa *d, int st)
+{
+	DfaState *s = &d->state[st];
+	size_t i, n = 0;
+	int node;
+
+	if (s->matchend < 0) {
+		for (i = 0; i < s->n; i++)
+			if (d->re->node[node = d->pool[s->off + i]].op == ReEol)
+				d->stack[n++] = node;
+		n = closure(d, n, AtEnd);
+		s->matchend = matches(d, d->set, n);
+	}
+	return s->matchend;
+}
+
+/* Return whether the text s holds a match of re.  Every byte is read at
+ * most once, looking up the next state in the cache of d or adding it. */
+int
+dfa_search(Dfa *d, const Regex *re, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	int st, next;
+
+	if (re->start < 0)
+		return 0;
+	if (d->re != re || d->gen != re->gen)
+		reset(d, re);
+	if (!len) {
+		/* both the start and the end, which no state tells apart */
+		d->stack[0] = re->start;
+		return matches(d, d->set, closure(d, 1, AtStart | AtEnd));
+	}
+	if ((st = d->startstate) < 0)
+		st = startstate(d);
+	for (; p < end; p++) {
+		if (d->state[st].match)
+			return 1;
+		if (!d->state[st].n)
+			return 0; /* no match can start after here */
+		if ((next = d->state[st].next[*p]) < 0)
+			next = step(d, st, *p);
+		st = next;
+	}
+	return d->state[st].match || matchend(d, st);
+}
@@ -0,0 +1,45 @@
+/* See LICENSE file for copyright and license details. */
+
+typedef struct {
+	unsigned char op, lo, hi; /* a byte in [lo, hi] for ReByte */
+	int out, out1;
+} ReNode;
+
+/* A regular expression compiled into a Thompson NFA */
+typedef struct {
+	ReNode *node;
+	size_t nnode, nodesize;
+	int start; /* -1 if the expression did not compile */
+	unsigned long gen; /* counts the compiles, to tell caches apart */
+	char *lit; /* text every match holds, or NULL */
+	size_t litlen;
+	char *buf; /* literal strings found while parsing */
+	size_t buflen, bufsize;
+	long *ranges; /* code point ranges of a bracket expression */
+	size_t nranges, rangesize;
+} Regex;
+
+typedef struct {
+	uint32_t off, n; /* set of NFA nodes in the pool */
+	signed char match, matchend; /* -1 while not known */
+	int next[256]; /* state after each byte, -1 while not built */
+} DfaState;
+
+/* The DFA of a Regex, built a state at a time as items are searched.  One
+ * is kept per thread. */
+typedef struct {
+	const Regex *re;
+	unsigned long gen;
+	DfaState *state;
+	size_t nstate;
+	int *hash; /* open addressing table of states */
+	int startstate;
+	int *pool; /* node sets of the states */
+	size_t npool, poolsize;
+	int *stack, *set; /* scratch for closures */
+	unsigned int *mark, markgen;
+} Dfa;
+
+/* Regex abstraction */
+int re_compile(Regex *re, const char *s, size_t len);
+int dfa_search(Dfa *d, const Regex *re, const char *s, size_t len);
@@ -1,20 +1,34 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <wayland-client.h>
-#include <wld/wayland.h>
 #include <wld/wld.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "dfa.h"
 #include "drw.h"
+#include "fold.h"
+#include "fuzzy.h"
+#include "hist.h"
+#include "idx.h"
+#include "search.h"
+#include "trigram.h"
 #include "util.h"
 #include "swc-client-protocol.h"
 
@@ -23,14 +37,40 @@
                              * MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define LENGTH(X)             (sizeof X / sizeof X[0])
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define ITEMTEXT(I)           (arena + itemoff[(I)])
+#define ITEMKEY(I)            (icase ? keys + keyoff[(I)] : ITEMTEXT(I))
+#define KEYLEN(I)             (icase ? keylen[(I)] : itemlen[(I)])
+#define ARENAMIN              (64 * 1024)  /* initial size of the stdin arena */
+#define STDINWAIT             50  /* ms to wait for stdin before mapping the menu */
+#define REDRAWRATE            30  /* ms between redraws while stdin streams in */
+#define MATCHDEPTH            32  /* earlier results kept to narrow and restore */
+#define PARALLELMIN           (64 * 1024)  /* items worth matching in parallel */
+#define CHUNKSPERWORKER       4
+#define RANKMIN               256  /* fuzzy matches ranked at once, a few pages */
+#define MATCHSLICE            4096  /* items matched before checking for enough */
+#define IDLESLICE             (64 * 1024)  /* items matched per idle pass */
 
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeOut, SchemeLast }; /* color schemes */
+enum { MatchExact, MatchPrefix, MatchSubstr, MatchLast }; /* match buckets */
+enum { ItemOut = 1 }; /* item flags */
+enum { CellBlank, CellPrompt, CellInput, CellLeft, CellRight, CellItem }; /* cell contents */
 
-struct item {
-	char *text;
-	struct item *left, *right;
-	int out;
+struct bucket {
+	uint32_t *idx; /* matching items, in input order */
+	size_t n, size;
+};
+
+struct result {
+	char *text; /* query the items were matched against */
+	size_t nitems; /* number of items matched so far */
+	size_t from; /* items before this one only match if in the result before */
+	struct bucket b[MatchLast];
+};
+
+struct chunk {
+	size_t lo, hi; /* range of items */
+	struct bucket b[MatchLast];
 };
 
 struct xkb {
@@ -47,16 +87,92 @@ static int bh, mw, mh;
 static int inputw = 0, promptw;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
-static struct item *items = NULL;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+static char *arena; /* item texts */
+static size_t arenasize, arenaused, linestart;
+static uint32_t *itemoff, *itemlen; /* text offset in arena and length */
+static unsigned char *itemflags;
+static unsigned int *itemw; /* TEXTW of each item, 0 until measured */
+static Fnt *widthfonts; /* fonts the widths were measured in */
+static unsigned int larroww, rarroww; /* TEXTW of "<" and ">" */
+static char *keys; /* case-folded item texts matched against with -i */
+static size_t keyssize, keysused;
+static uint32_t *keyoff, *keylen;
+static int icase;
+static Trigrams tri; /* trigrams of the items, with -t */
+static int usetri;
+static int fuzzy;
+static int useregex;
+static int stats; /* print drawing statistics on exit, with -s */
+static Regex re; /* the query, with -r */
+static int reok; /* whether it compiled */
+static pthread_key_t dfakey; /* the DFA of re built by each thread */
+static uint64_t *itemmask; /* bytes in the items, with -z */
+static int32_t *itemscore; /* scores of the current fuzzy matches */
+static uint32_t *ranked; /* best fuzzy matches, best first */
+static size_t nranked, rankcap;
+static History hist; /* items selected before, with -H */
+static struct histitem {
+	uint32_t item, frecency;
+} *histitems; /* items found in the history, most frecent first */
+static size_t nhistitems, histcap;
+static struct histpos {
+	size_t n;
+	size_t *first; /* positions of those items in a bucket, most frecent first */
+	size_t *sorted; /* the same in ascending order */
+} histpos[MatchLast];
+static int histranked;
+static size_t nitems, itemcap, imax, measured;
+static unsigned int imaxw;
+static struct result results[MATCHDEPTH]; /* each narrows the one before */
+static int depth; /* index of the current result */
+static struct bucket *matches = results[0].b;
+static size_t nmatches;
+static size_t prev, curr, next, sel; /* positions in the list of matches */
+static char query[FOLDSIZE(sizeof text)]; /* text, folded with -i */
+static size_t querysize;
+static char **tokv = NULL;
+static int tokc = 0;
+static size_t *toklen;
+static uint64_t querymask;
+static int nworkers; /* threads matching, 0 to use one per cpu */
+static pthread_t *workers;
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;
+static unsigned long jobgen; /* bumped for every job */
+static const struct result *jobres;
+static size_t jobfrom;
+static struct chunk *chunks;
+static size_t nchunks, nextchunk, chunksdone;
 static int mon = -1;
+static int uniq;
+static struct seen {
+	uint32_t hash;
+	uint32_t item; /* index + 1, or 0 if the slot is free */
+} *seen;
+static size_t seensize;
+static int stdineof;
+static int dirty; /* redraw once REDRAWRATE ms have passed */
+static int drawnow; /* redraw before waiting for events again */
+static int querydirty; /* the text changed since it was matched */
+static int moved; /* the selection was moved since the text was matched */
+static struct timespec lastdraw;
+static struct wl_callback *frame; /* set until the last frame is shown */
+static struct cell {
+	int x, y, w, h;
+	int what, scheme;
+	uint32_t item;
+} *cells, *lastcells; /* what each part of the frame shows, and showed */
+static size_t ncells, nlastcells, cellcap;
+static char lasttext[sizeof text];
+static size_t lastcursor;
 
 static struct wl_display *dpy;
 static struct wl_compositor *compositor;
 static struct wl_keyboard *kbd;
 static struct wl_seat *seat;
 static struct wl_shell *shell;
+static struct wl_shm *shm;
 static struct wl_surface *surface;
 static struct wl_data_device_manager *datadevman;
 static struct wl_data_device *datadev;
@@ -71,20 +187,225 @@ static Clr *scheme[SchemeLast];
 
 #include "config.h"
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
+static Findfn fstrstr;
 
 static void
-appenditem(struct item *item, struct item **list, struct item **last)
+growbucket(struct bucket *b, size_t n)
 {
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
+	if (b->n + n <= b->size)
+		return;
+	b->size = MAX(b->size ? b->size * 2 : 1024, b->n + n);
+	if (!(b->idx = realloc(b->idx, b->size * sizeof *b->idx)))
+		die("cannot realloc %zu bytes:", b->size * sizeof *b->idx);
+}
+
+static void
+appenditem(uint32_t i, struct bucket *b)
+{
+	if (b->n == b->size)
+		growbucket(b, 1);
+	b->idx[b->n++] = i;
+}
+
+/* return the position of the first index not below i in a bucket */
+static size_t
+lowerbound(const struct bucket *b, size_t i)
+{
+	size_t lo = 0, hi = b->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (b->idx[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* find the positions of the items in the history in the buckets */
+static void
+rankhist(void)
+{
+	struct histpos *h;
+	size_t i, k, m;
+	int j;
+
+	for (j = 0; j < MatchLast; j++)
+		histpos[j].n = 0;
+	for (i = 0; i < nhistitems; i++) {
+		for (j = 0; j < MatchLast; j++) {
+			k = lowerbound(&matches[j], histitems[i].item);
+			if (k < matches[j].n && matches[j].idx[k] == histitems[i].item)
+				break;
+		}
+		if (j == MatchLast)
+			continue; /* not a match */
+		h = &histpos[j];
+		h->first[h->n] = k;
+		for (m = h->n++; m > 0 && h->sorted[m - 1] > k; m--)
+			h->sorted[m] = h->sorted[m - 1];
+		h->sorted[m] = k;
+	}
+	histranked = 1;
+}
+
+/* return the item at position n of bucket j: the items in the history go
+ * first, most frecent first, then the others in input order */
+static uint32_t
+histmatch(int j, size_t n)
+{
+	const struct histpos *h = &histpos[j];
+	size_t i;
+
+	if (!histranked)
+		rankhist();
+	if (n < h->n)
+		return matches[j].idx[h->first[n]];
+	/* skip the positions taken by items in the history */
+	for (n -= h->n, i = 0; i < h->n && h->sorted[i] <= n; i++)
+		n++;
+	return matches[j].idx[n];
+}
+
+/* return whether fuzzy match a ranks above b: by score, then the shorter
+ * item, then the earlier */
+static int
+better(uint32_t a, uint32_t b)
+{
+	if (itemscore[a] != itemscore[b])
+		return itemscore[a] > itemscore[b];
+	if (itemlen[a] != itemlen[b])
+		return itemlen[a] < itemlen[b];
+	return a < b;
+}
+
+/* sift h[i] down a heap of n items whose root is the worst */
+static void
+siftdown(uint32_t *h, size_t n, size_t i)
+{
+	uint32_t x = h[i];
+	size_t c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && better(h[c], h[c + 1]))
+			c++;
+		if (!better(x, h[c]))
+			break;
+		h[i] = h[c];
+	}
+	h[i] = x;
+}
+
+/* put the best k fuzzy matches in order: a heap of the k best seen so far
+ * is kept while the matches are scanned, then sorted */
+static void
+rank(size_t k)
+{
+	const struct bucket *b = &matches[MatchSubstr];
+	uint32_t x;
+	size_t i;
+
+	k = MIN(k, b->n);
+	if (k > rankcap) {
+		rankcap = MAX(k, 2 * rankcap);
+		if (!(ranked = realloc(ranked, rankcap * sizeof *ranked)))
+			die("cannot realloc %zu bytes:", rankcap * sizeof *ranked);
+	}
+	memcpy(ranked, b->idx, k * sizeof *ranked);
+	for (i = k / 2; i > 0; i--)
+		siftdown(ranked, k, i - 1);
+	for (i = k; i < b->n; i++) {
+		if (k && better(b->idx[i], ranked[0])) {
+			ranked[0] = b->idx[i];
+			siftdown(ranked, k, 0);
+		}
+	}
+	for (i = k; i > 1; i--) {
+		x = ranked[0];
+		ranked[0] = ranked[i - 1];
+		ranked[i - 1] = x;
+		siftdown(ranked, i - 1, 0);
+	}
+	nranked = k;
+}
+
+/* return the item at position n in the list of matches; exact matches go
+ * first, then prefixes, then substrings.  Fuzzy matches are ranked as far
+ * as they are looked at. */
+static uint32_t
+nthmatch(size_t n)
+{
+	struct bucket *b;
+
+	if (fuzzy && tokc) {
+		if (n >= nranked)
+			rank(MAX(n + 1, MAX(2 * nranked, RANKMIN)));
+		return ranked[n];
+	}
+	for (b = matches; n >= b->n; b++)
+		n -= b->n;
+	if (nhistitems)
+		return histmatch(b - matches, n);
+	return b->idx[n];
+}
+
+/* return the position of a matching item in the list of matches, the
+ * inverse of nthmatch */
+static size_t
+itempos(uint32_t item)
+{
+	const struct bucket *b;
+	const struct histpos *h;
+	size_t i, k, pos = 0;
+	int j;
+
+	if (fuzzy && tokc) {
+		/* as many matches rank above it */
+		for (b = &matches[MatchSubstr], i = 0; i < b->n; i++)
+			pos += better(b->idx[i], item);
+		return pos;
+	}
+	for (j = 0; j < MatchLast; pos += matches[j++].n) {
+		b = &matches[j];
+		if ((k = lowerbound(b, item)) == b->n || b->idx[k] != item)
+			continue;
+		if (!nhistitems)
+			return pos + k;
+		if (!histranked)
+			rankhist();
+		h = &histpos[j];
+		for (i = 0; i < h->n; i++)
+			if (h->first[i] == k)
+				return pos + i;
+		/* after the items in the history, less those in front of it */
+		for (i = 0; i < h->n && h->sorted[i] < k; i++)
+			;
+		return pos + h->n + k - i;
+	}
+	return 0;
+}
 
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+/* forget the widths measured in other fonts than the current ones */
+static void
+checkfonts(void)
+{
+	if (widthfonts == drw->fonts)
+		return;
+	if (nitems)
+		memset(itemw, 0, nitems * sizeof *itemw);
+	larroww = TEXTW("<");
+	rarroww = TEXTW(">");
+	widthfonts = drw->fonts;
+}
+
+/* return the TEXTW of item i, measured only the first time */
+static int
+itemwidth(uint32_t i)
+{
+	if (!itemw[i])
+		itemw[i] = TEXTW(ITEMTEXT(i));
+	return itemw[i];
 }
 
 static void
@@ -92,158 +413,566 @@ calcoffsets(void)
 {
 	int i, n;
 
+	checkfonts();
 	if (lines > 0)
 		n = lines * bh;
 	else
-		n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
+		n = mw - (promptw + inputw + larroww + rarroww);
 	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : MIN(TEXTW(next->text), n)) > n)
+	for (i = 0, next = curr; next < nmatches; next++)
+		if ((i += (lines > 0) ? bh : MIN(itemwidth(nthmatch(next)), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : MIN(TEXTW(prev->left->text), n)) > n)
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += (lines > 0) ? bh : MIN(itemwidth(nthmatch(prev - 1)), n)) > n)
 			break;
 }
 
+/* report how many frames were drawn into how many buffers, with -s */
+static void
+printstats(void)
+{
+	if (stats)
+		fprintf(stderr, "dmenu: %lu frames, %lu buffers allocated, %lu waits for a buffer\n",
+		        drw->frames, drw->allocs, drw->waits);
+}
+
 static void
 cleanup(void)
 {
 	size_t i;
 
+	printstats();
 	for (i = 0; i < SchemeLast; i++)
 		free(scheme[i]);
 	drw_free(drw);
 	wl_display_disconnect(dpy);
 }
 
-static char *
-cistrstr(const char *s, const char *sub)
+static void
+addcell(int x, int y, int w, int h, int what, int scm, uint32_t item)
 {
-	size_t len;
+	struct cell *c;
 
-	for (len = strlen(sub); *s; s++)
-		if (!strncasecmp(s, sub, len))
-			return (char *)s;
-	return NULL;
+	if (w <= 0 || h <= 0)
+		return;
+	if (ncells == cellcap) {
+		cellcap = cellcap ? 2 * cellcap : 64;
+		if (!(cells = realloc(cells, cellcap * sizeof *cells)) ||
+		    !(lastcells = realloc(lastcells, cellcap * sizeof *lastcells)))
+			die("cannot realloc %zu bytes:", cellcap * sizeof *cells);
+	}
+	c = &cells[ncells++];
+	c->x = x;
+	c->y = y;
+	c->w = w;
+	c->h = h;
+	c->what = what;
+	c->scheme = scm;
+	c->item = item;
 }
 
-static int
-drawitem(struct item *item, int x, int y, int w)
+static void
+additemcell(size_t n, int x, int y, int w)
 {
-	if (item == sel)
-		drw_setscheme(drw, scheme[SchemeSel]);
-	else if (item->out)
-		drw_setscheme(drw, scheme[SchemeOut]);
+	uint32_t i = nthmatch(n);
+
+	if (n == sel)
+		addcell(x, y, w, bh, CellItem, SchemeSel, i);
+	else if (itemflags[i] & ItemOut)
+		addcell(x, y, w, bh, CellItem, SchemeOut, i);
 	else
-		drw_setscheme(drw, scheme[SchemeNorm]);
+		addcell(x, y, w, bh, CellItem, SchemeNorm, i);
+}
 
-	return drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
+static void
+framedone(void *d, struct wl_callback *cb, uint32_t time)
+{
+	wl_callback_destroy(cb);
+	frame = NULL;
 }
 
+static const struct wl_callback_listener framelistener = { framedone };
+
+/* lay out the menu as cells covering all of it */
 static void
-drawmenu(void)
+layout(void)
 {
-	unsigned int curpos;
-	struct item *item;
+	size_t i;
 	int x = 0, y = 0, w;
 
-	wld_set_target_surface(drw->renderer, drw->surface);
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_rect(drw, 0, 0, mw, mh, 1, 1);
-
+	ncells = 0;
 	if (prompt && *prompt) {
-		drw_setscheme(drw, scheme[SchemeSel]);
-		x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0);
-	}
-	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
-
-	drw_font_getexts(drw->fonts, text, cursor, &curpos, NULL);
-	if ((curpos += lrpad / 2 - 1) < w) {
-		drw_setscheme(drw, scheme[SchemeNorm]);
-		drw_rect(drw, x + curpos, 2, 2, bh - 4, 1, 0);
+		addcell(0, 0, promptw, bh, CellPrompt, SchemeSel, 0);
+		x = promptw;
 	}
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
+	addcell(x, 0, w, bh, CellInput, SchemeNorm, 0);
 
 	if (lines > 0) {
-		/* draw vertical list */
-		for (item = curr; item != next; item = item->right)
-			drawitem(item, x, y += bh, mw - x);
-	} else if (matches) {
-		/* draw horizontal list */
+		addcell(0, bh, x, mh - bh, CellBlank, SchemeNorm, 0);
+		for (i = curr; i < curr + lines; i++) {
+			if (i < next)
+				additemcell(i, x, y += bh, mw - x);
+			else
+				addcell(x, y += bh, mw - x, bh, CellBlank, SchemeNorm, 0);
+		}
+	} else if (nmatches) {
 		x += inputw;
-		w = TEXTW("<");
-		if (curr->left) {
-			drw_setscheme(drw, scheme[SchemeNorm]);
-			drw_text(drw, x, 0, w, bh, lrpad / 2, "<", 0);
+		addcell(x, 0, larroww, bh, curr > 0 ? CellLeft : CellBlank, SchemeNorm, 0);
+		x += larroww;
+		for (i = curr; i < next; i++) {
+			w = MIN(itemwidth(nthmatch(i)), mw - x - (int)rarroww);
+			additemcell(i, x, 0, w);
+			x += MAX(w, 0);
+		}
+		addcell(x, 0, mw - rarroww - x, bh, CellBlank, SchemeNorm, 0);
+		addcell(mw - rarroww, 0, rarroww, bh, next < nmatches ? CellRight : CellBlank, SchemeNorm, 0);
+	}
+}
+
+static int
+samecell(const struct cell *a, const struct cell *b)
+{
+	return a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h &&
+	       a->what == b->what && a->scheme == b->scheme && a->item == b->item &&
+	       (a->what != CellInput || (cursor == lastcursor && !strcmp(text, lasttext)));
+}
+
+static void
+drawcell(const struct cell *c)
+{
+	unsigned int curpos;
+
+	drw_setscheme(drw, scheme[c->scheme]);
+	switch (c->what) {
+	case CellBlank:
+		drw_rect(drw, c->x, c->y, c->w, c->h, 1, 1);
+		break;
+	case CellPrompt:
+		drw_text(drw, c->x, c->y, c->w, c->h, lrpad / 2, prompt, 0);
+		break;
+	case CellInput:
+		drw_text(drw, c->x, c->y, c->w, c->h, lrpad / 2, text, 0);
+		drw_font_getexts(drw->fonts, text, cursor, &curpos, NULL);
+		if ((curpos += lrpad / 2 - 1) < (unsigned int)c->w)
+			drw_rect(drw, c->x + curpos, 2, 2, bh - 4, 1, 0);
+		break;
+	case CellLeft:
+		drw_text(drw, c->x, c->y, c->w, c->h, lrpad / 2, "<", 0);
+		break;
+	case CellRight:
+		drw_text(drw, c->x, c->y, c->w, c->h, lrpad / 2, ">", 0);
+		break;
+	case CellItem:
+		drw_text_cached(drw, (uint64_t)c->item * SchemeLast + c->scheme,
+		                c->x, c->y, c->w, c->h, lrpad / 2, ITEMTEXT(c->item), 0);
+		break;
+	}
+}
+
+/* draw the cells which differ from the last frame, and those which are
+ * stale in the buffer drawn into */
+static void
+drawmenu(void)
+{
+	struct cell *tmp;
+	size_t i;
+	int changed = 0;
+
+	checkfonts();
+	layout();
+	for (i = 0; i < ncells; i++) {
+		if (i >= nlastcells || !samecell(&cells[i], &lastcells[i])) {
+			drw_damage(drw, cells[i].x, cells[i].y, cells[i].w, cells[i].h);
+			changed = 1;
+		}
+	}
+	if (changed) {
+		drw_begin(drw);
+		for (i = 0; i < ncells; i++)
+			if (drw_stale(drw, cells[i].x, cells[i].y, cells[i].w, cells[i].h))
+				drawcell(&cells[i]);
+		/* the next frame waits until the compositor shows this one */
+		if (surface) {
+			frame = wl_surface_frame(surface);
+			wl_callback_add_listener(frame, &framelistener, NULL);
+		}
+		drw_map(drw, surface);
+	}
+
+	tmp = lastcells;
+	lastcells = cells;
+	cells = tmp;
+	nlastcells = ncells;
+	strcpy(lasttext, text);
+	lastcursor = cursor;
+	clock_gettime(CLOCK_MONOTONIC, &lastdraw);
+	dirty = drawnow = 0;
+}
+
+/* score an item against every token, return whether it matches them all */
+static int
+fuzzyitem(uint32_t i)
+{
+	const char *s = ITEMKEY(i);
+	size_t len = KEYLEN(i);
+	int j, sc, score = 0;
+
+	if (querymask & ~itemmask[i])
+		return 0; /* lacks a byte of the query */
+	for (j = 0; j < tokc; j++) {
+		if (!fuzzyscore(s, len, tokv[j], toklen[j], &sc))
+			return 0;
+		score += sc;
+	}
+	itemscore[i] = score;
+	return 1;
+}
+
+/* return the DFA of the calling thread, made the first time */
+static Dfa *
+threaddfa(void)
+{
+	Dfa *d;
+
+	if (!(d = pthread_getspecific(dfakey))) {
+		d = ecalloc(1, sizeof *d);
+		if ((errno = pthread_setspecific(dfakey, d)))
+			die("pthread_setspecific:");
+	}
+	return d;
+}
+
+static void
+matchitem(uint32_t i, struct bucket *b)
+{
+	const char *s = ITEMKEY(i);
+	size_t len = KEYLEN(i);
+	int j;
+
+	if (useregex) {
+		/* the literal text in the regex is searched for first */
+		if (reok && (!re.lit || fstrstr(s, len, re.lit, re.litlen)) &&
+		    dfa_search(threaddfa(), &re, s, len))
+			appenditem(i, &b[MatchSubstr]);
+		return;
+	}
+	if (fuzzy) {
+		/* fuzzy matches are kept in input order and ranked later */
+		if (fuzzyitem(i))
+			appenditem(i, &b[MatchSubstr]);
+		return;
+	}
+	for (j = 0; j < tokc; j++)
+		if (!fstrstr(s, len, tokv[j], toklen[j]))
+			return; /* not all tokens match */
+	if (!tokc || (len + 1 == querysize && !memcmp(query, s, len)))
+		appenditem(i, &b[MatchExact]);
+	else if (len >= toklen[0] && !memcmp(tokv[0], s, toklen[0]))
+		appenditem(i, &b[MatchPrefix]);
+	else
+		appenditem(i, &b[MatchSubstr]);
+}
+
+/* match the items in [lo, hi) into b: those before from only if they are
+ * in the earlier result r, the others all */
+static void
+matchrange(struct bucket *b, const struct result *r, size_t from, size_t lo, size_t hi)
+{
+	size_t k[MatchLast], end[MatchLast];
+	int j, min;
+
+	if (r && lo < from) {
+		/* merge the buckets of r back into input order */
+		for (j = 0; j < MatchLast; j++) {
+			k[j] = lowerbound(&r->b[j], lo);
+			end[j] = lowerbound(&r->b[j], MIN(hi, from));
 		}
-		x += w;
-		for (item = curr; item != next; item = item->right)
-			x = drawitem(item, x, 0, MIN(TEXTW(item->text), mw - x - TEXTW(">")));
-		if (next) {
-			w = TEXTW(">");
-			drw_setscheme(drw, scheme[SchemeNorm]);
-			drw_text(drw, mw - w, 0, w, bh, lrpad / 2, ">", 0);
+		for (;;) {
+			for (min = -1, j = 0; j < MatchLast; j++)
+				if (k[j] < end[j] && (min < 0 || r->b[j].idx[k[j]] < r->b[min].idx[k[min]]))
+					min = j;
+			if (min < 0)
+				break;
+			matchitem(r->b[min].idx[k[min]++], b);
 		}
 	}
-	drw_map(drw, surface, 0, 0, mw, mh);
+	for (lo = MAX(lo, from); lo < hi; lo++)
+		matchitem(lo, b);
+}
+
+/* match chunks until none are left, called with poollock held */
+static void
+runchunks(void)
+{
+	struct chunk *c;
+	int j;
+
+	while (nextchunk < nchunks) {
+		c = &chunks[nextchunk++];
+		pthread_mutex_unlock(&poollock);
+		for (j = 0; j < MatchLast; j++)
+			c->b[j].n = 0;
+		matchrange(c->b, jobres, jobfrom, c->lo, c->hi);
+		pthread_mutex_lock(&poollock);
+		if (++chunksdone == nchunks)
+			pthread_cond_signal(&donecond);
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&poollock);
+	for (;;) {
+		while (gen == jobgen)
+			pthread_cond_wait(&jobcond, &poollock);
+		gen = jobgen;
+		runchunks();
+	}
+	return NULL;
+}
+
+/* split [lo, hi) into chunks matched by the workers and the calling
+ * thread, then append their buckets in order */
+static void
+matchparallel(const struct result *r, size_t from, size_t lo, size_t hi)
+{
+	size_t i, n = hi - lo;
+	int j;
+
+	pthread_mutex_lock(&poollock);
+	if (!workers) {
+		workers = ecalloc(nworkers - 1, sizeof *workers);
+		for (j = 0; j < nworkers - 1; j++)
+			if ((errno = pthread_create(&workers[j], NULL, worker, NULL)))
+				die("pthread_create:");
+		chunks = ecalloc(nworkers * CHUNKSPERWORKER, sizeof *chunks);
+	}
+	nchunks = nworkers * CHUNKSPERWORKER;
+	for (i = 0; i < nchunks; i++) {
+		chunks[i].lo = lo + n * i / nchunks;
+		chunks[i].hi = lo + n * (i + 1) / nchunks;
+	}
+	jobres = r;
+	jobfrom = from;
+	nextchunk = chunksdone = 0;
+	jobgen++;
+	pthread_cond_broadcast(&jobcond);
+	runchunks();
+	while (chunksdone < nchunks)
+		pthread_cond_wait(&donecond, &poollock);
+	pthread_mutex_unlock(&poollock);
+
+	for (j = 0; j < MatchLast; j++) {
+		for (i = 0, n = 0; i < nchunks; i++)
+			n += chunks[i].b[j].n;
+		growbucket(&matches[j], n);
+		for (i = 0; i < nchunks; i++) {
+			if (!chunks[i].b[j].n)
+				continue;
+			memcpy(matches[j].idx + matches[j].n, chunks[i].b[j].idx,
+			       chunks[i].b[j].n * sizeof *matches[j].idx);
+			matches[j].n += chunks[i].b[j].n;
+		}
+	}
+}
+
+/* append the items in [lo, hi) to the current result: those before from
+ * only if they are in the earlier result r, the others all */
+static void
+matchfrom(const struct result *r, size_t from, size_t lo, size_t hi)
+{
+	size_t i, n, work = nitems - MAX(lo, from);
+	uint32_t *cand;
+	int j;
+
+	for (j = 0; r && lo < from && j < MatchLast; j++)
+		work += r->b[j].n;
+	/* only the items holding all trigrams of the tokens have to be
+	 * searched, up to the last item if they are fewer than the others */
+	if (useregex && !reok) {
+		hi = nitems; /* nothing matches */
+	} else if (usetri && !fuzzy && (n = useregex ?
+	           tri_query(&tri, &re.lit, &re.litlen, re.lit != NULL, lo, &cand) :
+	           tri_query(&tri, tokv, toklen, tokc, lo, &cand)) < work) {
+		for (i = 0; i < n; i++)
+			matchitem(cand[i], matches);
+		hi = nitems;
+	} else if (nworkers > 1 && hi - lo >= PARALLELMIN)
+		matchparallel(r, from, lo, hi);
+	else
+		matchrange(matches, r, from, lo, hi);
+	results[depth].nitems = hi;
+	for (nmatches = 0, j = 0; j < MatchLast; j++)
+		nmatches += matches[j].n;
+	nranked = 0;
+	histranked = 0;
+}
+
+/* match up to n more items into the current result */
+static void
+matchslice(size_t n)
+{
+	struct result *res = &results[depth];
+	size_t hi = res->nitems + MIN(n, nitems - res->nitems);
+
+	if (depth > 0)
+		matchfrom(&results[depth - 1], res->from, res->nitems, hi);
+	else
+		matchfrom(NULL, 0, res->nitems, hi);
+}
+
+/* Match up to max more items into the current result, in growing slices,
+ * until it holds want matches.  A selection the user moved stays on the same
+ * item, the default one stays on the best match.  The rest is left to the
+ * idle passes of the event loop, so the first pages are shown without
+ * waiting for every item to be matched. */
+static void
+matchmore(size_t want, size_t max)
+{
+	size_t n;
+	uint32_t selitem = 0, curritem = 0;
+	int keep = nmatches && moved;
+
+	/* the matches are ranked again, so look the items up afterwards */
+	if (keep) {
+		selitem = nthmatch(sel);
+		curritem = nthmatch(curr);
+	}
+	for (n = MATCHSLICE; nmatches < want && max && results[depth].nitems < nitems; n *= 2) {
+		matchslice(MIN(n, max));
+		max -= MIN(n, max);
+	}
+	if (keep) {
+		sel = itempos(selitem);
+		curr = itempos(curritem);
+	}
+	calcoffsets();
+	if (sel >= next) {
+		/* more matches came in between the page and the selection */
+		curr = sel;
+		calcoffsets();
+	}
+}
+
+/* return how many items a page can show at most */
+static size_t
+pagelen(void)
+{
+	return lines > 0 ? lines : mw / MAX(lrpad, 1);
+}
+
+/* return whether every item matching the current tokens also matches q,
+ * that is whether each token of q occurs in one of them; a longer regex
+ * need not match fewer items */
+static int
+narrows(const char *q)
+{
+	static char buf[sizeof query];
+	size_t len;
+	char *s;
+	int j;
+
+	if (!q || useregex)
+		return 0;
+	strcpy(buf, q);
+	for (s = strtok(buf, " "); s; s = strtok(NULL, " ")) {
+		for (len = strlen(s), j = 0; j < tokc && !fstrstr(tokv[j], toklen[j], s, len); j++)
+			;
+		if (j == tokc)
+			return 0;
+	}
+	return 1;
 }
 
 static void
 match(void)
 {
-	static char **tokv = NULL;
+	static char buf[sizeof query];
 	static int tokn = 0;
 
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len, textsize;
-	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
+	struct result r;
+	size_t k;
+	char *s;
+	int i;
 
-	strcpy(buf, text);
+	querydirty = moved = 0;
+	if (icase)
+		query[utf8fold(query, text, strlen(text))] = '\0';
+	else
+		strcpy(query, text);
+	querysize = strlen(query) + 1;
+	if (useregex)
+		reok = re_compile(&re, query, querysize - 1);
+	strcpy(buf, query);
 	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
+	for (tokc = 0, s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
+		if (++tokc > tokn && (!(tokv = realloc(tokv, ++tokn * sizeof *tokv)) ||
+		    !(toklen = realloc(toklen, tokn * sizeof *toklen))))
 			die("cannot realloc %u bytes:", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
-
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
-				break;
-		if (i != tokc) /* not all tokens match */
-			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &matches, &matchend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		else
-			appenditem(item, &lsubstr, &substrend);
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		} else
-			matches = lprefix;
-		matchend = prefixend;
+	for (querymask = 0, i = 0; i < tokc; i++) {
+		toklen[i] = strlen(tokv[i]);
+		querymask |= fuzzymask(tokv[i], toklen[i]);
 	}
-	if (lsubstr) {
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
-		} else
-			matches = lsubstr;
-		matchend = substrend;
+
+	/* go back to the latest result which the new query narrows down */
+	while (depth > 0 && !narrows(results[depth].text))
+		depth--;
+	if (results[depth].text && !strcmp(results[depth].text, query)) {
+		/* restore it, to be matched further below */
+		matches = results[depth].b;
+		for (k = 0; fuzzy && k < matches[MatchSubstr].n; k++)
+			fuzzyitem(matches[MatchSubstr].idx[k]); /* scored since */
+	} else {
+		if (narrows(results[depth].text) && ++depth == MATCHDEPTH) {
+			/* forget the oldest result */
+			r = results[0];
+			memmove(results, results + 1, (MATCHDEPTH - 1) * sizeof *results);
+			results[--depth] = r;
+		}
+		if (!(results[depth].text = realloc(results[depth].text, querysize)))
+			die("cannot realloc %zu bytes:", querysize);
+		strcpy(results[depth].text, query);
+		matches = results[depth].b;
+		for (i = 0; i < MatchLast; i++)
+			matches[i].n = 0;
+		results[depth].nitems = 0;
+		results[depth].from = depth > 0 ? results[depth - 1].nitems : 0;
 	}
-	curr = sel = matches;
+	for (nmatches = 0, i = 0; i < MatchLast; i++)
+		nmatches += matches[i].n;
+	nranked = 0;
+	histranked = 0;
+	curr = sel = 0;
+	matchmore(2 * pagelen() + 1, SIZE_MAX); /* enough for two pages */
+	curr = sel = 0; /* the selection starts at the top */
 	calcoffsets();
 }
 
+/* set the input field width from the widest item in the primary font */
+static void
+measureitems(void)
+{
+	unsigned int w, cap = mw / 3, maxadv = drw->fonts->wld->max_advance;
+
+	checkfonts();
+	/* the width is capped at mw/3, so stop measuring once it is reached */
+	for (; measured < nitems && imaxw + lrpad < cap; measured++) {
+		/* no glyph advances further than the font's max advance */
+		if ((size_t)itemlen[measured] * maxadv <= imaxw)
+			continue;
+		drw_font_getexts(drw->fonts, ITEMTEXT(measured), itemlen[measured], &w, NULL);
+		if (w > imaxw) {
+			imaxw = w;
+			imax = measured;
+		}
+	}
+	inputw = nitems ? MIN(itemwidth(imax), cap) : 0;
+}
+
 static void
 insert(const char *str, ssize_t n)
 {
@@ -254,7 +983,7 @@ insert(const char *str, ssize_t n)
 	if (n > 0)
 		memcpy(&text[cursor], str, n);
 	cursor += n;
-	match();
+	querydirty = 1; /* matched once the pending events are handled */
 }
 
 static size_t
@@ -268,12 +997,39 @@ nextrune(int inc)
 	return n;
 }
 
+/* record that item i was selected in the history */
+static void
+remember(uint32_t i)
+{
+	hist_add(&hist, ITEMTEXT(i), itemlen[i], time(NULL));
+}
+
+/* return whether the key only inserts or deletes text, or is a modifier,
+ * so that it can be handled before the text is matched */
+static int
+editkey(xkb_keysym_t ksym, const char *buf, int mod)
+{
+	switch (ksym) {
+	case XKB_KEY_NoSymbol:
+	case XKB_KEY_BackSpace:
+	case XKB_KEY_Delete:
+	case XKB_KEY_Mode_switch:
+	case XKB_KEY_Num_Lock:
+		return 1;
+	}
+	if ((ksym >= XKB_KEY_Shift_L && ksym <= XKB_KEY_Hyper_R) ||
+	    (ksym >= XKB_KEY_ISO_Lock && ksym <= XKB_KEY_ISO_Level5_Lock))
+		return 1;
+	return !mod && *buf && !iscntrl((unsigned char)*buf);
+}
+
 static void
 kbdkey(void *d, struct wl_keyboard *kbd, uint32_t serial, uint32_t time,
        uint32_t key, uint32_t state)
 {
-	char buf[32];
+	char buf[32] = "";
 	int len;
+	size_t osel, ocurr;
 	xkb_keysym_t ksym = XKB_KEY_NoSymbol;
 	int ctrl = xkb_state_mod_index_is_active(xkb.state, xkb.ctrl, XKB_STATE_MODS_EFFECTIVE);
 	int shift = xkb_state_mod_index_is_active(xkb.state, xkb.shift, XKB_STATE_MODS_EFFECTIVE);
@@ -283,7 +1039,8 @@ kbdkey(void *d, struct wl_keyboard *kbd, uint32_t serial, uint32_t time,
 		goto update_state;
 
 	ksym = xkb_state_key_get_one_sym(xkb.state, key + 8);
-	len = xkb_keysym_to_utf8(ksym, buf, sizeof buf) - 1;
+	if ((len = xkb_keysym_to_utf8(ksym, buf, sizeof buf) - 1) < 0)
+		*buf = '\0'; /* no text, or too long */
 	if (ctrl)
 		switch(ksym) {
 		case XKB_KEY_a: ksym = XKB_KEY_Home;      break;
@@ -304,7 +1061,7 @@ kbdkey(void *d, struct wl_keyboard *kbd, uint32_t serial, uint32_t time,
 
 		case XKB_KEY_k: /* delete right */
 			text[cursor] = '\0';
-			match();
+			querydirty = 1;
 			break;
 		case XKB_KEY_u: /* delete left */
 			insert(NULL, 0 - cursor);
@@ -339,9 +1096,14 @@ kbdkey(void *d, struct wl_keyboard *kbd, uint32_t serial, uint32_t time,
 		default:
 			return;
 		}
+	osel = sel;
+	ocurr = curr;
+	/* only keys editing the text can do without matching it first */
+	if (querydirty && !editkey(ksym, buf, ctrl || alt))
+		match();
 	switch (ksym) {
 	default:
-		if (!iscntrl(*buf))
+		if (*buf && !iscntrl((unsigned char)*buf))
 			insert(buf, len);
 		break;
 	case XKB_KEY_Delete:
@@ -359,30 +1121,33 @@ kbdkey(void *d, struct wl_keyboard *kbd, uint32_t serial, uint32_t time,
 			cursor = strlen(text);
 			break;
 		}
-		if (next) {
+		matchmore(SIZE_MAX, SIZE_MAX);
+		if (next < nmatches) {
 			/* jump to end of list and position items in reverse */
-			curr = matchend;
+			curr = nmatches - 1;
 			calcoffsets();
 			curr = prev;
 			calcoffsets();
-			while (next && (curr = curr->right))
+			while (next < nmatches) {
+				curr++;
 				calcoffsets();
+			}
 		}
-		sel = matchend;
+		sel = nmatches ? nmatches - 1 : 0;
 		break;
 	case XKB_KEY_Escape:
 		cleanup();
 		exit(1);
 	case XKB_KEY_Home:
-		if (sel == matches) {
+		if (sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XKB_KEY_Left:
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		if (cursor > 0 && (sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -390,32 +1155,37 @@ kbdkey(void *d, struct wl_keyboard *kbd, uint32_t serial, uint32_t time,
 			return;
 		/* fallthrough */
 	case XKB_KEY_Up:
-		if (sel && sel->left && (sel = sel->left)->right == curr) {
+		if (sel > 0 && sel-- == curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XKB_KEY_Next:
-		if (!next)
+		matchmore(next + 2 * pagelen(), SIZE_MAX);
+		if (next >= nmatches)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XKB_KEY_Prior:
-		if (!prev)
+		if (!nmatches)
 			return;
 		sel = curr = prev;
 		calcoffsets();
 		break;
 	case XKB_KEY_Return:
 	case XKB_KEY_KP_Enter:
-		puts((sel && !shift) ? sel->text : text);
+		if (!moved && !shift)
+			matchmore(SIZE_MAX, SIZE_MAX); /* the best match may come last */
+		if (nmatches && !shift)
+			remember(nthmatch(sel));
+		puts((nmatches && !shift) ? ITEMTEXT(nthmatch(sel)) : text);
 		if (!ctrl) {
 			cleanup();
 			exit(0);
 		}
-		if(sel)
-			sel->out = 1;
+		if (nmatches)
+			itemflags[nthmatch(sel)] |= ItemOut;
 		break;
 	case XKB_KEY_Right:
 		if (text[cursor] != '\0') {
@@ -426,21 +1196,27 @@ kbdkey(void *d, struct wl_keyboard *kbd, uint32_t serial, uint32_t time,
 			return;
 		/* fallthrough */
 	case XKB_KEY_Down:
-		if (sel && sel->right && (sel = sel->right) == next) {
+		if (sel + 1 == next)
+			matchmore(next + pagelen(), SIZE_MAX);
+		if (sel + 1 < nmatches && ++sel == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XKB_KEY_Tab:
-		if (!sel)
+		if (!moved)
+			matchmore(SIZE_MAX, SIZE_MAX);
+		if (!nmatches)
 			return;
-		strncpy(text, sel->text, sizeof text - 1);
+		strncpy(text, ITEMTEXT(nthmatch(sel)), sizeof text - 1);
 		text[sizeof text - 1] = '\0';
 		cursor = strlen(text);
-		match();
+		querydirty = 1;
 		break;
 	}
-	drawmenu();
+	if (sel != osel || curr != ocurr)
+		moved = 1;
+	drawnow = 1;
 
 update_state:
 	xkb_state_update_key(xkb.state, key + 8,
@@ -461,44 +1237,417 @@ paste(void)
 		while((len = read(fds[0], buf, sizeof buf)) > 0)
 			insert(buf, (nl = strchr(buf, '\n')) ? nl - buf : len);
 		close(fds[0]);
-		drawmenu();
+		drawnow = 1;
+	}
+}
+
+static void
+growitems(void)
+{
+	if (nitems == UINT32_MAX)
+		die("too many items");
+	itemcap = itemcap ? MIN(itemcap * 2, UINT32_MAX) : 1024;
+	if (!(itemoff = realloc(itemoff, itemcap * sizeof *itemoff)) ||
+	    !(itemlen = realloc(itemlen, itemcap * sizeof *itemlen)) ||
+	    !(itemflags = realloc(itemflags, itemcap * sizeof *itemflags)) ||
+	    !(itemw = realloc(itemw, itemcap * sizeof *itemw)))
+		die("cannot realloc %zu items:", itemcap);
+	if (icase && (!(keyoff = realloc(keyoff, itemcap * sizeof *keyoff)) ||
+	    !(keylen = realloc(keylen, itemcap * sizeof *keylen))))
+		die("cannot realloc %zu items:", itemcap);
+	if (fuzzy && (!(itemmask = realloc(itemmask, itemcap * sizeof *itemmask)) ||
+	    !(itemscore = realloc(itemscore, itemcap * sizeof *itemscore))))
+		die("cannot realloc %zu items:", itemcap);
+}
+
+/* fold the text of the next item into its key */
+static void
+addkey(const char *s, size_t len)
+{
+	size_t need = keysused + FOLDSIZE(len) + 1;
+
+	if (need > keyssize) {
+		keyssize = MAX(MAX(keyssize * 2, need), ARENAMIN);
+		if (keyssize - 1 > UINT32_MAX)
+			die("stdin is too large");
+		if (!(keys = realloc(keys, keyssize)))
+			die("cannot realloc %zu bytes:", keyssize);
+	}
+	keyoff[nitems] = keysused;
+	keylen[nitems] = utf8fold(keys + keysused, s, len);
+	keysused += keylen[nitems];
+	keys[keysused++] = '\0';
+}
+
+/* look text up among the items read so far, adding it to the table of
+ * seen items if it is new */
+static int
+isdup(const char *text, size_t len)
+{
+	struct seen *old = seen;
+	uint32_t h = 2166136261U;
+	size_t i, j, mask, oldsize = seensize;
+
+	if (2 * (nitems + 1) > seensize) {
+		seensize = seensize ? seensize * 2 : 1024;
+		seen = ecalloc(seensize, sizeof *seen);
+		for (i = 0, mask = seensize - 1; i < oldsize; i++) {
+			if (!old[i].item)
+				continue;
+			for (j = old[i].hash & mask; seen[j].item; j = (j + 1) & mask)
+				;
+			seen[j] = old[i];
+		}
+		free(old);
+	}
+	/* FNV-1a */
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)text[i]) * 16777619U;
+	for (i = h & (mask = seensize - 1); seen[i].item; i = (i + 1) & mask) {
+		j = seen[i].item - 1;
+		if (seen[i].hash == h && itemlen[j] == len && !memcmp(ITEMTEXT(j), text, len))
+			return 1;
+	}
+	seen[i].hash = h;
+	seen[i].item = nitems + 1;
+	return 0;
+}
+
+/* note the frecency of item i if it is in the history */
+static void
+addhist(uint32_t i)
+{
+	unsigned int f;
+	size_t j;
+
+	if (!(f = hist_frecency(&hist, ITEMTEXT(i), itemlen[i], time(NULL))))
+		return;
+	if (nhistitems == histcap) {
+		histcap = histcap ? histcap * 2 : 64;
+		if (!(histitems = realloc(histitems, histcap * sizeof *histitems)))
+			die("cannot realloc %zu bytes:", histcap * sizeof *histitems);
+		for (j = 0; j < MatchLast; j++)
+			if (!(histpos[j].first = realloc(histpos[j].first, histcap * sizeof(size_t))) ||
+			    !(histpos[j].sorted = realloc(histpos[j].sorted, histcap * sizeof(size_t))))
+				die("cannot realloc %zu bytes:", histcap * sizeof(size_t));
+	}
+	for (j = nhistitems++; j > 0 && histitems[j - 1].frecency < f; j--)
+		histitems[j] = histitems[j - 1];
+	histitems[j].item = i;
+	histitems[j].frecency = f;
+	histranked = 0;
+}
+
+static void
+additem(size_t off, size_t len)
+{
+	if (uniq && isdup(arena + off, len))
+		return;
+	if (nitems == itemcap)
+		growitems();
+	itemoff[nitems] = off;
+	itemlen[nitems] = len;
+	itemflags[nitems] = 0;
+	itemw[nitems] = 0;
+	if (icase)
+		addkey(arena + off, len);
+	if (usetri)
+		tri_add(&tri, nitems, arena + off, len);
+	if (fuzzy)
+		itemmask[nitems] = fuzzymask(ITEMKEY(nitems), KEYLEN(nitems));
+	if (hist.h)
+		addhist(nitems);
+	nitems++;
+}
+
+/* split the newline-terminated lines of [s, end) in place, returning the
+ * start of the trailing partial line; [s, p) is known to hold no newline */
+static char *
+splitlines(char *s, char *p, char *end)
+{
+	char *nl;
+
+	while ((nl = memchr(p, '\n', end - p))) {
+		*nl = '\0';
+		additem(s - arena, nl - s);
+		s = p = nl + 1;
+	}
+	return s;
+}
+
+static void
+loadindex(const char *file)
+{
+	const IdxHeader *h;
+	const uint32_t *off, *len, *koff, *klen, *width = NULL;
+	const IdxGram *g;
+	char *base, fontkey[sizeof h->fonts] = "";
+	struct stat st;
+	size_t i, j;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		die("cannot open '%s':", file);
+	if ((size_t)st.st_size < sizeof *h)
+		die("%s: not a dmenu index", file);
+	if ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		die("cannot mmap '%s':", file);
+	close(fd);
+
+	h = (const IdxHeader *)base;
+#define INSIDE(off, size) ((off) <= st.st_size && (size) <= st.st_size - (off))
+	/* the tables are used in place, so they have to be aligned */
+	if ((h->textoff | h->textlen | h->keyoff | h->keylen | h->widths) % sizeof(uint32_t) ||
+	    h->grams % sizeof(uint64_t) ||
+	    memcmp(h->magic, IDXMAGIC, sizeof h->magic) || h->version != IDXVERSION ||
+	    !INSIDE(h->textoff, h->nitems * 4ULL) || !INSIDE(h->textlen, h->nitems * 4ULL) ||
+	    !INSIDE(h->keyoff, h->nitems * 4ULL) || !INSIDE(h->keylen, h->nitems * 4ULL) ||
+	    !INSIDE(h->text, h->textsize) || !INSIDE(h->keys, h->keysize) ||
+	    (h->widths && !INSIDE(h->widths, h->nitems * 4ULL)) ||
+	    (h->grams && (!INSIDE(h->grams, h->ngrams * sizeof(IdxGram)) ||
+	    !INSIDE(h->postings, h->postingsize))))
+		die("%s: not a dmenu index", file);
+#undef INSIDE
+	off = (const uint32_t *)(base + h->textoff);
+	len = (const uint32_t *)(base + h->textlen);
+	koff = (const uint32_t *)(base + h->keyoff);
+	klen = (const uint32_t *)(base + h->keylen);
+	/* every item is used as a C string, so it has to end in a NUL */
+	for (i = 0; i < h->nitems; i++)
+		if (off[i] >= h->textsize || len[i] >= h->textsize - off[i] ||
+		    koff[i] >= h->keysize || klen[i] >= h->keysize - koff[i] ||
+		    base[h->text + off[i] + len[i]] || base[h->keys + koff[i] + klen[i]])
+			die("%s: not a dmenu index", file);
+
+	/* use the cached widths if they were measured in our fonts */
+	for (i = 0; i < LENGTH(fonts) && strlen(fontkey) + strlen(fonts[i]) + 2 <= sizeof fontkey; i++)
+		strcat(strcat(fontkey, fonts[i]), "\n");
+	if (h->widths && !strncmp(fontkey, h->fonts, sizeof h->fonts))
+		width = (const uint32_t *)(base + h->widths);
+
+	arena = base + h->text;
+	hist_lock(&hist);
+	if (!uniq) {
+		/* use the tables in place */
+		itemoff = (uint32_t *)off;
+		itemlen = (uint32_t *)len;
+		keys = base + h->keys;
+		keyoff = (uint32_t *)koff;
+		keylen = (uint32_t *)klen;
+		if ((nitems = h->nitems)) {
+			itemflags = ecalloc(nitems, sizeof *itemflags);
+			itemw = ecalloc(nitems, sizeof *itemw);
+		}
+		if (fuzzy && nitems) {
+			itemmask = ecalloc(nitems, sizeof *itemmask);
+			itemscore = ecalloc(nitems, sizeof *itemscore);
+			for (i = 0; i < nitems; i++)
+				itemmask[i] = fuzzymask(ITEMKEY(i), KEYLEN(i));
+		}
+		for (i = 0; hist.h && i < nitems; i++)
+			addhist(i);
 	}
+	if (usetri && !uniq && h->grams) {
+		/* use the posting lists in place */
+		for (g = (const IdxGram *)(base + h->grams), i = 0; i < h->ngrams; i++, g++) {
+			if (!g->n || g->off > h->postingsize || g->len > h->postingsize - g->off)
+				die("%s: not a dmenu index", file);
+			tri_insert(&tri, g->gram, g->n, (unsigned char *)base + h->postings + g->off, g->len);
+		}
+	} else if (usetri && !uniq) {
+		for (i = 0; i < nitems; i++)
+			tri_add(&tri, i, ITEMTEXT(i), itemlen[i]);
+	}
+	for (i = j = 0; (uniq || width) && i < h->nitems; i++) {
+		if (uniq) {
+			additem(off[i], len[i]);
+			if (nitems == j) /* dropped as a duplicate */
+				continue;
+		}
+		if (width && width[i] > imaxw) {
+			imaxw = width[i];
+			imax = j;
+		}
+		j++;
+	}
+	hist_unlock(&hist);
+	if (width)
+		measured = nitems;
 }
 
+static int
+mapstdin(void)
+{
+	struct stat st;
+	off_t off;
+	char *p;
+
+	if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    (off = lseek(STDIN_FILENO, 0, SEEK_CUR)) < 0)
+		return 0;
+	if (off >= st.st_size)
+		return 1;
+	if (st.st_size > UINT32_MAX)
+		die("stdin is too large");
+	/* map one zeroed byte past the end of the file, so the last line is
+	 * terminated even if it lacks a newline */
+	p = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return 0;
+	if (mmap(p, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	         STDIN_FILENO, 0) == MAP_FAILED) {
+		munmap(p, st.st_size + 1);
+		return 0;
+	}
+	arena = p;
+	hist_lock(&hist);
+	p = splitlines(p + off, p + off, p + st.st_size);
+	if (*p)
+		additem(p - arena, strlen(p));
+	hist_unlock(&hist);
+	return 1;
+}
+
+/* do a single read from stdin, which must be readable */
 static void
 readstdin(void)
 {
-	char buf[sizeof text], *p;
-	size_t i, imax = 0, size = 0;
-	unsigned int tmpmax = 0;
-
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; fgets(buf, sizeof buf, stdin); i++) {
-		if (i + 1 >= size / sizeof *items)
-			if (!(items = realloc(items, (size += BUFSIZ))))
-				die("cannot realloc %u bytes:", size);
-		if ((p = strchr(buf, '\n')))
-			*p = '\0';
-		if (!(items[i].text = strdup(buf)))
-			die("cannot strdup %u bytes:", strlen(buf) + 1);
-		items[i].out = 0;
-		drw_font_getexts(drw->fonts, buf, strlen(buf), &tmpmax, NULL);
-		if (tmpmax > inputw) {
-			inputw = tmpmax;
-			imax = i;
+	ssize_t n;
+
+	/* complete lines are split in place, a trailing partial line stays at
+	 * the end of the arena until the rest of it is read */
+	if (arenaused + 1 >= arenasize) {
+		arenasize = arenasize ? arenasize * 2 : ARENAMIN;
+		if (arenasize - 1 > UINT32_MAX)
+			die("stdin is too large");
+		if (!(arena = realloc(arena, arenasize)))
+			die("cannot realloc %zu bytes:", arenasize);
+	}
+	if ((n = read(STDIN_FILENO, arena + arenaused, arenasize - arenaused - 1)) < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		die("read:");
+	}
+	hist_lock(&hist);
+	if (n == 0) {
+		stdineof = 1;
+		if (arenaused > linestart) {
+			arena[arenaused] = '\0';
+			additem(linestart, arenaused - linestart);
 		}
+	} else {
+		linestart = splitlines(arena + linestart, arena + arenaused, arena + arenaused + n) - arena;
+		arenaused += n;
+	}
+	hist_unlock(&hist);
+}
+
+static long
+msince(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* read stdin until end-of-file, or until STDINWAIT ms have passed */
+static void
+waitstdin(void)
+{
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	struct timespec start;
+	long ms;
+
+	if (mapstdin()) {
+		stdineof = 1;
+		return;
 	}
-	if (items)
-		items[i].text = NULL;
-	inputw = items ? TEXTW(items[imax].text) : 0;
-	lines = MIN(lines, i);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (ms = STDINWAIT; !stdineof && ms > 0 && poll(&pfd, 1, ms) > 0; ms = STDINWAIT - msince(&start))
+		readstdin();
+}
+
+static void
+stdinready(void)
+{
+	size_t n = nitems;
+
+	readstdin();
+	if (nitems == n)
+		return;
+	measureitems();
+	/* the new items are matched with the rest of them when idle */
+	dirty = 1;
 }
 
 static void
 run(void)
 {
-	while (wl_display_dispatch(dpy) != -1)
-		;
+	struct epoll_event ev[2];
+	int efd, i, n, timeout, dispfd = wl_display_get_fd(dpy);
+
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("epoll_create1:");
+	ev[0].events = EPOLLIN;
+	ev[0].data.fd = dispfd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, dispfd, &ev[0]) < 0)
+		die("epoll_ctl:");
+	if (!stdineof) {
+		ev[0].data.fd = STDIN_FILENO;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, STDIN_FILENO, &ev[0]) < 0) {
+			/* stdin cannot be polled, so it never blocks */
+			while (!stdineof)
+				stdinready();
+		}
+	}
+
+	for (;;) {
+		while (wl_display_prepare_read(dpy) != 0)
+			if (wl_display_dispatch_pending(dpy) < 0)
+				return;
+		wl_display_flush(dpy);
+
+		if (querydirty || (drawnow && !frame) || results[depth].nitems < nitems)
+			timeout = 0; /* only poll, there is work left */
+		else if (dirty && !frame)
+			timeout = MAX(REDRAWRATE - msince(&lastdraw), 0);
+		else
+			timeout = -1; /* a frame callback wakes us up to draw */
+		if ((n = epoll_wait(efd, ev, LENGTH(ev), timeout)) < 0) {
+			wl_display_cancel_read(dpy);
+			if (errno == EINTR)
+				continue;
+			die("epoll_wait:");
+		}
+		for (i = 0; i < n && ev[i].data.fd != dispfd; i++)
+			;
+		if (i < n) {
+			if (wl_display_read_events(dpy) < 0)
+				return;
+		} else
+			wl_display_cancel_read(dpy);
+		if (wl_display_dispatch_pending(dpy) < 0)
+			return;
+
+		for (i = 0; i < n; i++)
+			if (ev[i].data.fd == STDIN_FILENO) {
+				stdinready();
+				if (stdineof)
+					epoll_ctl(efd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+			}
+		/* all keys read so far are handled, so the text is matched and
+		 * drawn once for all of them, at most once a frame */
+		if (querydirty)
+			match();
+		if (!frame && (drawnow || (dirty && msince(&lastdraw) >= REDRAWRATE)))
+			drawmenu();
+		if (results[depth].nitems < nitems) {
+			matchmore(SIZE_MAX, IDLESLICE);
+			dirty = 1;
+		}
+	}
 }
 
 /* wayland event handlers */
@@ -509,6 +1658,8 @@ regglobal(void *d, struct wl_registry *r, uint32_t name, const char *interface,
 		compositor = wl_registry_bind(r, name, &wl_compositor_interface, 1);
 	else if(strcmp(interface, "wl_shell") == 0)
 		shell = wl_registry_bind(r, name, &wl_shell_interface, 1);
+	else if(strcmp(interface, "wl_shm") == 0)
+		shm = wl_registry_bind(r, name, &wl_shm_interface, 1);
 	else if(strcmp(interface, "wl_seat") == 0)
 		seat = wl_registry_bind(r, name, &wl_seat_interface, 1);
 	else if(strcmp(interface, "wl_data_device_manager") == 0)
@@ -642,15 +1793,18 @@ static const struct swc_panel_listener panellistener = { paneldocked };
 static void
 setup(void)
 {
-	if (!compositor || !seat || !panelman)
-		exit(1);
+	/* without a display, the menu is only drawn into memory */
+	if (dpy) {
+		if (!compositor || !shm || !seat || !panelman)
+			exit(1);
 
-	kbd = wl_seat_get_keyboard(seat);
-	wl_keyboard_add_listener(kbd, &kbdlistener, NULL);
-	datadev = wl_data_device_manager_get_data_device(datadevman, seat);
-	wl_data_device_add_listener(datadev, &datadevlistener, NULL);
+		kbd = wl_seat_get_keyboard(seat);
+		wl_keyboard_add_listener(kbd, &kbdlistener, NULL);
+		datadev = wl_data_device_manager_get_data_device(datadevman, seat);
+		wl_data_device_add_listener(datadev, &datadevlistener, NULL);
 
-	xkb.context = xkb_context_new(0);
+		xkb.context = xkb_context_new(0);
+	}
 
 	/* init appearance */
 	scheme[SchemeNorm] = drw_scm_create(drw, colors[SchemeNorm], 2);
@@ -659,33 +1813,57 @@ setup(void)
 
 	/* calculate menu geometry */
 	bh = drw->fonts->wld->height + 2;
-	lines = MAX(lines, 0);
+	if (stdineof)
+		lines = MIN(lines, nitems);
 	mh = (lines + 1) * bh;
 
 	/* create menu surface */
-	surface = wl_compositor_create_surface(compositor);
+	if (dpy) {
+		surface = wl_compositor_create_surface(compositor);
 
-	panel = swc_panel_manager_create_panel(panelman, surface);
-	swc_panel_add_listener(panel, &panellistener, NULL);
-	swc_panel_dock(panel, topbar ? SWC_PANEL_EDGE_TOP : SWC_PANEL_EDGE_BOTTOM, screen, 1);
+		panel = swc_panel_manager_create_panel(panelman, surface);
+		swc_panel_add_listener(panel, &panellistener, NULL);
+		swc_panel_dock(panel, topbar ? SWC_PANEL_EDGE_TOP : SWC_PANEL_EDGE_BOTTOM, screen, 1);
 
-	wl_display_roundtrip(dpy);
+		wl_display_roundtrip(dpy);
+	} else {
+		mw = headlessw;
+	}
 	if (!mw)
 		exit(1);
 
 	promptw = (prompt && *prompt) ? TEXTW(prompt) - lrpad / 4 : 0;
-	inputw = MIN(inputw, mw/3);
+	measureitems();
 	match();
 
-	drw_resize(drw, surface, mw, mh);
+	drw_resize(drw, mw, mh);
+	nlastcells = 0; /* a new surface shows nothing yet */
 	drawmenu();
 }
 
+/* return where the fonts matched are cached, or NULL if nowhere */
+static const char *
+fontcachefile(void)
+{
+	static char path[PATH_MAX];
+	const char *dir;
+	int n;
+
+	if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+		n = snprintf(path, sizeof path, "%s/dmenu_fonts", dir);
+	else if ((dir = getenv("HOME")))
+		n = snprintf(path, sizeof path, "%s/.cache/dmenu_fonts", dir);
+	else
+		return NULL;
+	return n < (int)sizeof path ? path : NULL;
+}
+
 static void
 usage(void)
 {
-	fputs("usage: dmenu [-biv] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
-	      "             [-nb color] [-nf color] [-sb color] [-sf color]\n", stderr);
+	fputs("usage: dmenu [-birstuvz] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
+	      "             [-nb color] [-nf color] [-sb color] [-sf color] [-F file]\n"
+	      "             [-j threads] [-H histfile] [-P file]\n", stderr);
 	exit(1);
 }
 
@@ -693,8 +1871,11 @@ int
 main(int argc, char *argv[])
 {
 	struct wl_registry *reg;
+	const char *idxfile = NULL, *histfile = NULL, *ppmfile = NULL;
+	FILE *fp;
 	int i;
 
+	fstrstr = findfn();
 	for (i = 1; i < argc; i++)
 		/* these options take no arguments */
 		if (!strcmp(argv[i], "-v")) {      /* prints version information */
@@ -702,16 +1883,27 @@ main(int argc, char *argv[])
 			exit(0);
 		} else if (!strcmp(argv[i], "-b")) /* appears at the bottom of the screen */
 			topbar = 0;
-		else if (!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
-			fstrncmp = strncasecmp;
-			fstrstr = cistrstr;
-		} else if (i + 1 == argc)
+		else if (!strcmp(argv[i], "-i")) /* case-insensitive item matching */
+			icase = 1;
+		else if (!strcmp(argv[i], "-u")) /* drop duplicate items */
+			uniq = 1;
+		else if (!strcmp(argv[i], "-t")) /* match with a trigram index */
+			usetri = 1;
+		else if (!strcmp(argv[i], "-z")) /* fuzzy matching */
+			fuzzy = 1;
+		else if (!strcmp(argv[i], "-r")) /* regular expression matching */
+			useregex = 1;
+		else if (!strcmp(argv[i], "-s")) /* print drawing statistics on exit */
+			stats = 1;
+		else if (i + 1 == argc)
 			usage();
 		/* these options take one argument */
 		else if (!strcmp(argv[i], "-l"))   /* number of lines in vertical list */
 			lines = atoi(argv[++i]);
 		else if (!strcmp(argv[i], "-m"))
 			mon = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-j"))   /* number of threads matching */
+			nworkers = atoi(argv[++i]);
 		else if (!strcmp(argv[i], "-p"))   /* adds prompt to left of input field */
 			prompt = argv[++i];
 		else if (!strcmp(argv[i], "-fn"))  /* font or font set */
@@ -724,23 +1916,56 @@ main(int argc, char *argv[])
 			colors[SchemeSel][ColBg] = argv[++i];
 		else if (!strcmp(argv[i], "-sf"))  /* selected foreground color */
 			colors[SchemeSel][ColFg] = argv[++i];
+		else if (!strcmp(argv[i], "-F"))   /* read items from an index file */
+			idxfile = argv[++i];
+		else if (!strcmp(argv[i], "-H"))   /* rank items by a history file */
+			histfile = argv[++i];
+		else if (!strcmp(argv[i], "-P"))   /* draw the menu into an image */
+			ppmfile = argv[++i];
 		else
 			usage();
+	if (nworkers < 1 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nworkers = 1;
+	if (histfile)
+		hist_open(&hist, histfile);
+	if (useregex) {
+		fuzzy = 0; /* a regex is matched as it is */
+		if ((errno = pthread_key_create(&dfakey, NULL)))
+			die("pthread_key_create:");
+	}
 
 	if (!setlocale(LC_CTYPE, ""))
 		fputs("warning: no locale support\n", stderr);
-	if (!(dpy = wl_display_connect(NULL)))
-		die("cannot open display");
-	if (!(reg = wl_display_get_registry(dpy)))
-		die("cannot get registry");
-	wl_registry_add_listener(reg, &reglistener, NULL);
-	wl_display_roundtrip(dpy);
-	drw = drw_create(dpy);
+	if (!ppmfile) {
+		if (!(dpy = wl_display_connect(NULL)))
+			die("cannot open display");
+		if (!(reg = wl_display_get_registry(dpy)))
+			die("cannot get registry");
+		wl_registry_add_listener(reg, &reglistener, NULL);
+		wl_display_roundtrip(dpy);
+	}
+	drw = drw_create(dpy, shm);
+	drw->fontcache = fontcachefile();
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
 	lrpad = drw->fonts->wld->height;
-
-	readstdin();
+	drw->rowbudget = (size_t)rowcache * 1024;
+
+	if (idxfile) {
+		loadindex(idxfile);
+		stdineof = 1;
+	} else
+		waitstdin();
+	if (ppmfile) {
+		/* draw the first frame of the menu of every item */
+		while (!stdineof)
+			readstdin();
+		setup();
+		if (!(fp = fopen(ppmfile, "w")) || drw_dump(drw, fp) < 0 || fclose(fp) == EOF)
+			die("cannot write '%s':", ppmfile);
+		printstats();
+		return 0;
+	}
 	setup();
 	run();
 
@@ -0,0 +1,181 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include <wld/wld.h>
+
+#include "drw.h"
+#include "fold.h"
+#include "idx.h"
+#include "trigram.h"
+#include "util.h"
+
+#define LENGTH(X) (sizeof X / sizeof X[0])
+
+typedef struct {
+	char *data;
+	size_t len, cap;
+} Buf;
+
+static void
+bufadd(Buf *b, const void *p, size_t n)
+{
+	if (b->len + n > b->cap) {
+		b->cap = MAX(b->cap * 2, b->len + n);
+		if (!(b->data = realloc(b->data, b->cap)))
+			die("cannot realloc %zu bytes:", b->cap);
+	}
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+static void
+bufadd32(Buf *b, size_t n)
+{
+	uint32_t u = n;
+
+	bufadd(b, &u, sizeof u);
+}
+
+static void
+writebuf(FILE *fp, const Buf *b)
+{
+	if (b->len && fwrite(b->data, 1, b->len, fp) != b->len)
+		die("write:");
+}
+
+static void
+usage(void)
+{
+	fputs("usage: dmenu_index [-t] [-fn font]... file\n", stderr);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	IdxHeader h = { .version = IDXVERSION };
+	Buf text = { 0 }, keys = { 0 }, textoff = { 0 }, textlen = { 0 };
+	Buf keyoff = { 0 }, keylen = { 0 }, widths = { 0 }, grams = { 0 }, postings = { 0 };
+	Trigrams tri = { 0 };
+	IdxGram g = { 0 };
+	const char *fonts[8], *out;
+	char *line = NULL, *key = NULL, *tmp;
+	size_t i, size = 0, nfonts = 0, keysize = 0;
+	ssize_t len;
+	Drw *drw = NULL;
+	FILE *fp;
+	mode_t mask;
+	int fd, usetri = 0;
+
+	for (i = 1; i + 1 < argc; i++)
+		if (!strcmp(argv[i], "-t"))
+			usetri = 1;
+		else if (!strcmp(argv[i], "-fn") && nfonts < LENGTH(fonts))
+			fonts[nfonts++] = argv[++i];
+		else
+			usage();
+	if (i + 1 != argc)
+		usage();
+	out = argv[i];
+
+	memcpy(h.magic, IDXMAGIC, sizeof h.magic);
+	if (nfonts) {
+		drw = drw_create(NULL, NULL);
+		if (!drw_fontset_create(drw, fonts, nfonts))
+			die("no fonts could be loaded.");
+		for (i = 0; i < nfonts; i++)
+			if (strlen(h.fonts) + strlen(fonts[i]) + 2 > sizeof h.fonts)
+				die("font names too long");
+			else
+				strcat(strcat(h.fonts, fonts[i]), "\n");
+	}
+
+	while ((len = getline(&line, &size, stdin)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (h.nitems == UINT32_MAX || text.len + len + 1 > UINT32_MAX)
+			die("too much input");
+		bufadd32(&textoff, text.len);
+		bufadd32(&textlen, len);
+		bufadd(&text, line, len + 1);
+		if (drw)
+			bufadd32(&widths, drw_fontset_getwidth(drw, line));
+		if (FOLDSIZE(len) + 1 > keysize && !(key = realloc(key, keysize = FOLDSIZE(len) + 1)))
+			die("cannot realloc %zu bytes:", keysize);
+		i = utf8fold(key, line, len);
+		key[i] = '\0';
+		if (keys.len + i + 1 > UINT32_MAX)
+			die("too much input");
+		bufadd32(&keyoff, keys.len);
+		bufadd32(&keylen, i);
+		bufadd(&keys, key, i + 1);
+		if (usetri)
+			tri_add(&tri, h.nitems, key, i);
+		h.nitems++;
+	}
+	if (ferror(stdin))
+		die("read:");
+
+	for (i = 0; i < tri.size; i++) {
+		if (!tri.tab[i].n)
+			continue;
+		g.gram = tri.tab[i].gram;
+		g.n = tri.tab[i].n;
+		g.len = tri.tab[i].len;
+		g.off = postings.len;
+		bufadd(&grams, &g, sizeof g);
+		bufadd(&postings, tri.tab[i].data, tri.tab[i].len);
+	}
+
+	/* the tables come first, so they stay aligned */
+	h.grams = usetri ? sizeof h : 0;
+	h.ngrams = grams.len / sizeof g;
+	h.textoff = sizeof h + grams.len;
+	h.textlen = h.textoff + textoff.len;
+	h.keyoff = h.textlen + textlen.len;
+	h.keylen = h.keyoff + keyoff.len;
+	h.widths = drw ? h.keylen + keylen.len : 0;
+	h.text = h.keylen + keylen.len + widths.len;
+	h.textsize = text.len;
+	h.keys = h.text + text.len;
+	h.keysize = keys.len;
+	h.postings = h.keys + keys.len;
+	h.postingsize = postings.len;
+
+	/* write to a temporary file, so readers never see a partial index */
+	if (!(tmp = malloc(strlen(out) + sizeof ".XXXXXX")))
+		die("malloc:");
+	sprintf(tmp, "%s.XXXXXX", out);
+	if ((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w")))
+		die("cannot create '%s':", tmp);
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	if (fwrite(&h, sizeof h, 1, fp) != 1)
+		die("write:");
+	writebuf(fp, &grams);
+	writebuf(fp, &textoff);
+	writebuf(fp, &textlen);
+	writebuf(fp, &keyoff);
+	writebuf(fp, &keylen);
+	writebuf(fp, &widths);
+	writebuf(fp, &text);
+	writebuf(fp, &keys);
+	writebuf(fp, &postings);
+	if (fclose(fp) == EOF)
+		die("write:");
+	if (rename(tmp, out) < 0)
+		die("cannot rename '%s' to '%s':", tmp, out);
+
+	if (drw) {
+		drw_fontset_free(drw->fonts);
+		drw_free(drw);
+	}
+	return 0;
+}
@@ -1,16 +1,23 @@
 /* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <wayland-client.h>
 #include <wld/wld.h>
-#include <wld/wayland.h>
+#include <wld/pixman.h>
 
 #include "drw.h"
 #include "util.h"
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define TEXTMAX     1024 /* bytes of a run of text drawn at once */
+#define RUNESMIN    256  /* entries in a new table of runes */
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -61,74 +68,269 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+static void
+bufrelease(void *data, struct wl_buffer *wl)
+{
+	((DrwBuf *)data)->busy = 0;
+}
+
+static const struct wl_buffer_listener buflistener = { bufrelease };
+
+static void
+freebuf(DrwBuf *b)
+{
+	if (!b->buffer)
+		return;
+	wld_buffer_unreference(b->buffer);
+	if (b->wl) {
+		wl_buffer_destroy(b->wl);
+		munmap(b->data, (size_t)b->w * b->h * 4);
+	}
+	b->buffer = NULL;
+	b->wl = NULL;
+	b->busy = 0;
+}
+
+/* open an unlinked file of size bytes in shared memory */
+static int
+shmfile(size_t size)
+{
+	static unsigned int serial;
+	char name[64];
+	int fd;
+
+	do {
+		snprintf(name, sizeof name, "/dmenu-%ld-%u", (long)getpid(), serial++);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	} while (fd < 0 && errno == EEXIST);
+	if (fd < 0)
+		return -1;
+	shm_unlink(name);
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* give b a buffer shared with the compositor */
+static void
+shmbuf(Drw *drw, DrwBuf *b)
+{
+	struct wl_shm_pool *pool;
+	size_t stride = (size_t)drw->w * 4, size = stride * drw->h;
+	int fd;
+
+	if ((fd = shmfile(size)) < 0)
+		die("cannot allocate %zu bytes of shared memory:", size);
+	if ((b->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		die("cannot mmap shared memory:");
+	pool = wl_shm_create_pool(drw->shm, fd, size);
+	b->wl = wl_shm_pool_create_buffer(pool, 0, drw->w, drw->h, stride, WL_SHM_FORMAT_XRGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	wl_proxy_set_queue((struct wl_proxy *)b->wl, drw->queue);
+	wl_buffer_add_listener(b->wl, &buflistener, b);
+	b->buffer = wld_import_buffer(drw->ctx, WLD_OBJECT_DATA, (union wld_object){ .ptr = b->data },
+	                              drw->w, drw->h, WLD_FORMAT_XRGB8888, stride);
+	if (!b->buffer)
+		die("cannot import buffer");
+}
+
+/* give b a buffer the size of the surface, only in memory if there is no
+ * compositor to share it with */
+static void
+allocbuf(Drw *drw, DrwBuf *b)
+{
+	freebuf(b);
+	if (drw->shm)
+		shmbuf(drw, b);
+	else if (!(b->buffer = wld_create_buffer(drw->ctx, drw->w, drw->h, WLD_FORMAT_XRGB8888, 0)) ||
+	         !wld_map(b->buffer))
+		die("cannot create buffer");
+	else
+		b->data = b->buffer->map;
+	b->w = drw->w;
+	b->h = drw->h;
+	pixman_region32_fini(&b->stale);
+	pixman_region32_init_rect(&b->stale, 0, 0, b->w, b->h);
+	drw->allocs++;
+}
+
 Drw *
-drw_create(struct wl_display *dpy)
+drw_create(struct wl_display *dpy, struct wl_shm *shm)
 {
 	Drw *drw = ecalloc(1, sizeof(Drw));
+	size_t i;
 
 	drw->dpy = dpy;
-	drw->ctx = wld_wayland_create_context(dpy, WLD_ANY);
-	drw->renderer = wld_create_renderer(drw->ctx);
+	drw->shm = shm;
+	drw->ctx = wld_pixman_context;
 	drw->fontctx = wld_font_create_context();
+	pixman_region32_init(&drw->damage);
+	for (i = 0; i < DRW_BUFS; i++)
+		pixman_region32_init(&drw->bufs[i].stale);
+	/* without a display, frames are drawn only into memory */
+	drw->renderer = wld_create_renderer(drw->ctx);
+	if (dpy)
+		drw->queue = wl_display_create_queue(dpy);
 
 	return drw;
 }
 
+/* The buffers are kept across resizes; one of another size is allocated
+ * again only when it is next drawn into. */
 void
-drw_resize(Drw *drw, struct wl_surface *surface, unsigned int w, unsigned int h)
+drw_resize(Drw *drw, unsigned int w, unsigned int h)
 {
-	if (drw->surface)
-		wld_destroy_surface(drw->surface);
-	drw->surface = wld_wayland_create_surface(drw->ctx, w, h, WLD_FORMAT_XRGB8888, 0, surface);
+	drw->w = w;
+	drw->h = h;
 }
 
 void
 drw_free(Drw *drw)
 {
-	wld_destroy_surface(drw->surface);
+	size_t i;
+
+	for (i = 0; i < DRW_BUFS; i++) {
+		freebuf(&drw->bufs[i]);
+		pixman_region32_fini(&drw->bufs[i].stale);
+	}
 	wld_destroy_renderer(drw->renderer);
-	wld_destroy_context(drw->ctx);
+	if (drw->queue)
+		wl_event_queue_destroy(drw->queue);
 	wld_font_destroy_context(drw->fontctx);
+	pixman_region32_fini(&drw->damage);
+	free(drw->runes);
+	drw_rows_forget(drw);
+	free(drw->rows);
 	free(drw);
 }
 
+/* return the pattern of the font which name matched when last looked
+ * up, from the font cache, or NULL if it is not there or the font file
+ * changed since */
+static FcPattern *
+cachedmatch(Drw *drw, const char *name)
+{
+	FcPattern *match = NULL, *p;
+	FcChar8 *file;
+	FILE *fp;
+	struct stat st;
+	char *line = NULL, *end;
+	size_t size = 0, n = strlen(name);
+	ssize_t len;
+	long long mtime;
+
+	if (!drw->fontcache || !(fp = fopen(drw->fontcache, "r")))
+		return NULL;
+	/* lines are name, mtime of the file and the match, the last one wins */
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (strncmp(line, name, n) || line[n] != '\t')
+			continue;
+		mtime = strtoll(line + n + 1, &end, 10);
+		if (*end != '\t' || !(p = FcNameParse((FcChar8 *)end + 1)))
+			continue;
+		if (FcPatternGetString(p, FC_FILE, 0, &file) == FcResultMatch &&
+		    stat((char *)file, &st) == 0 && st.st_mtime == mtime) {
+			if (match)
+				FcPatternDestroy(match);
+			match = p;
+		} else {
+			FcPatternDestroy(p);
+		}
+	}
+	free(line);
+	fclose(fp);
+	return match;
+}
+
+/* add what name matched to the font cache */
+static void
+cachematch(Drw *drw, const char *name, FcPattern *match)
+{
+	FcObjectSet *os;
+	FcPattern *p;
+	FcChar8 *file, *s;
+	FILE *fp;
+	struct stat st;
+
+	if (!drw->fontcache || strpbrk(name, "\t\n") ||
+	    FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch ||
+	    stat((char *)file, &st) < 0)
+		return;
+	/* what wld opens the font with */
+	os = FcObjectSetBuild(FC_FILE, FC_INDEX, FC_SIZE, FC_PIXEL_SIZE, FC_ASPECT,
+	                      FC_MATRIX, FC_ANTIALIAS, FC_HINTING, FC_HINT_STYLE,
+	                      FC_AUTOHINT, FC_RGBA, FC_LCD_FILTER, FC_EMBOLDEN, (char *)NULL);
+	p = FcPatternFilter(match, os);
+	if ((s = FcNameUnparse(p)) && !strpbrk((char *)s, "\t\n") &&
+	    (fp = fopen(drw->fontcache, "a"))) {
+		fprintf(fp, "%s\t%lld\t%s\n", name, (long long)st.st_mtime, s);
+		fclose(fp);
+	}
+	free(s);
+	FcPatternDestroy(p);
+	FcObjectSetDestroy(os);
+}
+
+/* open the font name, as wld_font_open_name would, without asking
+ * fontconfig for a match if the font cache has it */
+static struct wld_font *
+openname(Drw *drw, const char *name)
+{
+	struct wld_font *wld = NULL;
+	FcPattern *pattern, *match;
+	FcResult result;
+
+	if ((match = cachedmatch(drw, name))) {
+		wld = wld_font_open_pattern(drw->fontctx, match);
+		FcPatternDestroy(match);
+		if (wld)
+			return wld;
+	}
+	if (!(pattern = FcNameParse((FcChar8 *)name)))
+		return NULL;
+	FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+	FcDefaultSubstitute(pattern);
+	if ((match = FcFontMatch(NULL, pattern, &result))) {
+		if ((wld = wld_font_open_pattern(drw->fontctx, match)))
+			cachematch(drw, name, match);
+		FcPatternDestroy(match);
+	}
+	FcPatternDestroy(pattern);
+	return wld;
+}
+
+/* open a font of the set the first time it is needed; return whether it
+ * could be */
+static int
+loadfont(Drw *drw, Fnt *font)
+{
+	if (!font->wld && font->name && !(font->wld = openname(drw, font->name))) {
+		fprintf(stderr, "error, cannot load font from name: '%s'\n", font->name);
+		font->name = NULL; /* do not try again */
+	}
+	return font->wld != NULL;
+}
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
 static Fnt *
-wldfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
+wldfont_create(Drw *drw, FcPattern *fontpattern)
 {
 	Fnt *font;
-	struct wld_font *wld = NULL;
-	FcPattern *pattern = NULL;
+	struct wld_font *wld;
 
-	if (fontname) {
-		/* Using the pattern found at font->xfont->pattern does not yield the
-		 * same substitution results as using the pattern returned by
-		 * FcNameParse; using the latter results in the desired fallback
-		 * behaviour whereas the former just results in missing-character
-		 * rectangles being drawn, at least with some fonts. */
-		if (!(wld = wld_font_open_name(drw->fontctx, fontname))) {
-			fprintf(stderr, "error, cannot load font from name: '%s'\n", fontname);
-			return NULL;
-		}
-		if (!(pattern = FcNameParse((FcChar8 *) fontname))) {
-			fprintf(stderr, "error, cannot parse font name to pattern: '%s'\n", fontname);
-			wld_font_close(wld);
-			return NULL;
-		}
-	} else if (fontpattern) {
-		if (!(wld = wld_font_open_pattern(drw->fontctx, fontpattern))) {
-			fprintf(stderr, "error, cannot load font from pattern.\n");
-			return NULL;
-		}
-	} else {
-		die("no font specified.");
+	if (!(wld = wld_font_open_pattern(drw->fontctx, fontpattern))) {
+		fprintf(stderr, "error, cannot load font from pattern.\n");
+		return NULL;
 	}
-
 	font = ecalloc(1, sizeof(Fnt));
 	font->wld = wld;
-	font->pattern = pattern;
 
 	return font;
 }
@@ -140,10 +342,121 @@ wldfont_free(Fnt *font)
 		return;
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
-	wld_font_close(font->wld);
+	if (font->wld)
+		wld_font_close(font->wld);
 	free(font);
 }
 
+static void
+forgetrunes(Drw *drw)
+{
+	if (drw->runes)
+		memset(drw->runes, 0, drw->runesize * sizeof *drw->runes);
+	drw->nrunes = 0;
+}
+
+static FntRune *
+runeslot(FntRune *tab, size_t size, uint32_t rune)
+{
+	size_t i, mask = size - 1;
+
+	for (i = (rune * 2654435761U) & mask; tab[i].rune && tab[i].rune != rune; i = (i + 1) & mask)
+		;
+	return &tab[i];
+}
+
+static void
+cacherune(Drw *drw, long u, Fnt *font)
+{
+	FntRune *old = drw->runes, *e;
+	size_t i, size = drw->runesize;
+
+	if (2 * (drw->nrunes + 1) > size) {
+		/* rehash into a table twice the size */
+		drw->runesize = size ? 2 * size : RUNESMIN;
+		drw->runes = ecalloc(drw->runesize, sizeof *drw->runes);
+		for (i = 0; i < size; i++)
+			if (old[i].rune)
+				*runeslot(drw->runes, drw->runesize, old[i].rune) = old[i];
+		free(old);
+	}
+	e = runeslot(drw->runes, drw->runesize, u + 1);
+	e->rune = u + 1;
+	e->font = font;
+	drw->nrunes++;
+}
+
+/* ask fontconfig for a font which has the rune u, add it to the set and
+ * return it, or NULL if there is none */
+static Fnt *
+fallbackfont(Drw *drw, long u)
+{
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcPattern *match;
+	FcResult result;
+	Fnt *font = NULL, *curfont;
+
+	if (!drw->fonts->pattern) {
+		/* Using the pattern of the font matched does not yield the same
+		 * substitution results as using the pattern returned by
+		 * FcNameParse; using the latter results in the desired fallback
+		 * behaviour whereas the former just results in missing-character
+		 * rectangles being drawn, at least with some fonts. */
+		if (!drw->fonts->name ||
+		    !(drw->fonts->pattern = FcNameParse((FcChar8 *)drw->fonts->name)))
+			die("the first font in the cache must be loaded from a font string.");
+	}
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, u);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = FcFontMatch(NULL, fcpattern, &result);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (match) {
+		font = wldfont_create(drw, match);
+		if (font && wld_font_ensure_char(font->wld, u)) {
+			for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+				; /* NOP */
+			curfont->next = font;
+		} else {
+			wldfont_free(font);
+			font = NULL;
+		}
+	}
+	return font;
+}
+
+/* Return the font to draw the rune u with: the first in the set which has
+ * it, else a fallback font, else the first one regardless.  The answer is
+ * kept, so every rune is looked up in the fonts once, and one which no font
+ * has does not set off another search for a fallback each time. */
+static Fnt *
+runefont(Drw *drw, long u)
+{
+	FntRune *e;
+	Fnt *font;
+
+	if (drw->runesize && (e = runeslot(drw->runes, drw->runesize, u + 1))->rune)
+		return e->font ? e->font : drw->fonts;
+	for (font = drw->fonts; font; font = font->next)
+		if (loadfont(drw, font) && wld_font_ensure_char(font->wld, u))
+			break;
+	if (!font)
+		font = fallbackfont(drw, u);
+	cacherune(drw, u, font);
+	return font ? font : drw->fonts;
+}
+
 Fnt*
 drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 {
@@ -154,11 +467,18 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 		return NULL;
 
 	for (i = 1; i <= fontcount; i++) {
-		if ((cur = wldfont_create(drw, fonts[fontcount - i], NULL))) {
-			cur->next = ret;
-			ret = cur;
-		}
+		cur = ecalloc(1, sizeof(Fnt));
+		cur->name = fonts[fontcount - i];
+		cur->next = ret;
+		ret = cur;
+	}
+	/* open only the first font which loads, the others when needed */
+	while (ret && !loadfont(drw, ret)) {
+		cur = ret->next;
+		wldfont_free(ret);
+		ret = cur;
 	}
+	forgetrunes(drw);
 	return (drw->fonts = ret);
 }
 
@@ -200,8 +520,11 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw) {
+		forgetrunes(drw);
+		drw_rows_forget(drw);
 		drw->fonts = set;
+	}
 }
 
 void
@@ -227,22 +550,47 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 	}
 }
 
+/* return the length of the longest prefix of the len bytes of text which
+ * ends on a character and is at most w wide, and set *ew to its width;
+ * the prefixes are bisected, so long text takes few extents calls */
+static size_t
+fitlen(Fnt *font, const char *text, size_t len, unsigned int w, unsigned int *ew)
+{
+	unsigned short end[TEXTMAX]; /* where each character ends */
+	unsigned int mw;
+	size_t i, n, lo, hi, mid;
+	long u;
+
+	drw_font_getexts(font, text, len, ew, NULL);
+	if (*ew <= w)
+		return len;
+	for (n = 0, i = 0; i < len; end[n++] = i)
+		i += MAX(utf8decode(text + i, &u, MIN(UTF_SIZ, len - i)), 1);
+	/* the first lo characters fit, the first hi do not */
+	for (*ew = 0, lo = 0, hi = n; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		drw_font_getexts(font, text, end[mid - 1], &mw, NULL);
+		if (mw <= w) {
+			lo = mid;
+			*ew = mw;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo ? end[lo - 1] : 0;
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
-	char buf[1024];
+	char buf[TEXTMAX];
 	int ty;
 	unsigned int ew;
-	Fnt *usedfont, *curfont, *nextfont;
+	Fnt *usedfont, *nextfont;
 	size_t i, len;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	FcResult result;
-	int charexists = 0;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
@@ -262,30 +610,15 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || wld_font_ensure_char(curfont->wld,  utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
+			if ((nextfont = runefont(drw, utf8codepoint)) != usedfont)
 				break;
-			else
-				charexists = 0;
+			utf8strlen += utf8charlen;
+			text += utf8charlen;
 		}
 
 		if (utf8strlen) {
-			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
 			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+			len = fitlen(usedfont, utf8str, MIN(utf8strlen, sizeof(buf) - 1), w, &ew);
 
 			if (len) {
 				memcpy(buf, utf8str, len);
@@ -304,61 +637,190 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			}
 		}
 
-		if (!*text) {
+		if (!*text)
 			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
+		usedfont = nextfont;
+	}
 
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in wldfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
+	return x + (render ? w : 0);
+}
 
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+#define ROWBYTES(W, H) ((size_t)(W) * (H) * 4)
 
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = FcFontMatch(NULL, fcpattern, &result);
+/* evict the least recently used rows until size more bytes fit */
+static void
+evictrows(Drw *drw, size_t size)
+{
+	size_t i, lru;
+
+	while (drw->nrows && drw->rowbytes + size > drw->rowbudget) {
+		for (lru = 0, i = 1; i < drw->nrows; i++)
+			if (drw->rows[i].used < drw->rows[lru].used)
+				lru = i;
+		drw->rowbytes -= ROWBYTES(drw->rows[lru].w, drw->rows[lru].h);
+		wld_buffer_unreference(drw->rows[lru].buffer);
+		drw->rows[lru] = drw->rows[--drw->nrows];
+	}
+}
 
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
+/* Draw text like drw_text, keeping what it renders in a buffer named by
+ * key, which must tell apart every text and scheme drawn with it.  Text
+ * drawn again with the same key and size is then only copied. */
+void
+drw_text_cached(Drw *drw, uint64_t key, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+{
+	struct wld_buffer *buffer;
+	DrwRow *r;
+	size_t i, size = ROWBYTES(w, h);
 
-			if (match) {
-				usedfont = wldfont_create(drw, NULL, match);
-				if (usedfont && wld_font_ensure_char(usedfont->wld, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					wldfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
+	if (!drw || !drw->scheme || !text || !drw->fonts || !w || !h)
+		return;
+	for (i = 0; i < drw->nrows; i++)
+		if (drw->rows[i].key == key && drw->rows[i].w == w && drw->rows[i].h == h)
+			break;
+	if (i == drw->nrows) {
+		if (size > drw->rowbudget || !drw->back) {
+			drw_text(drw, x, y, w, h, lpad, text, invert);
+			return;
+		}
+		evictrows(drw, size);
+		if (!(buffer = wld_create_buffer(drw->ctx, w, h, WLD_FORMAT_XRGB8888, 0))) {
+			drw_text(drw, x, y, w, h, lpad, text, invert);
+			return;
 		}
+		if (drw->nrows == drw->rowcap) {
+			drw->rowcap = drw->rowcap ? 2 * drw->rowcap : 64;
+			if (!(drw->rows = realloc(drw->rows, drw->rowcap * sizeof *drw->rows)))
+				die("cannot realloc %zu bytes:", drw->rowcap * sizeof *drw->rows);
+		}
+		wld_set_target_buffer(drw->renderer, buffer);
+		drw_text(drw, 0, 0, w, h, lpad, text, invert);
+		wld_flush(drw->renderer);
+		wld_set_target_buffer(drw->renderer, drw->back->buffer);
+		r = &drw->rows[i = drw->nrows++];
+		r->key = key;
+		r->w = w;
+		r->h = h;
+		r->buffer = buffer;
+		drw->rowbytes += size;
 	}
+	r = &drw->rows[i];
+	r->used = ++drw->rowclock;
+	wld_copy_rectangle(drw->renderer, r->buffer, x, y, 0, 0, w, h);
+}
 
-	return x + (render ? w : 0);
+/* drop every row kept rendered */
+void
+drw_rows_forget(Drw *drw)
+{
+	size_t i;
+
+	for (i = 0; i < drw->nrows; i++)
+		wld_buffer_unreference(drw->rows[i].buffer);
+	drw->nrows = drw->rowbytes = 0;
 }
 
+/* mark a rectangle as changed since the last frame */
 void
-drw_map(Drw *drw, struct wl_surface *surface, int x, int y, unsigned int w, unsigned int h)
+drw_damage(Drw *drw, int x, int y, unsigned int w, unsigned int h)
 {
-	if (!drw)
+	pixman_region32_union_rect(&drw->damage, &drw->damage, x, y, w, h);
+}
+
+/* return the buffer the compositor does not hold which was drawn into
+ * last, so the least of it is stale, or NULL if it holds them all */
+static DrwBuf *
+idlebuf(Drw *drw)
+{
+	DrwBuf *b = NULL;
+	size_t i;
+
+	for (i = 0; i < DRW_BUFS; i++)
+		if (!drw->bufs[i].busy && (!b || drw->bufs[i].drawn > b->drawn))
+			b = &drw->bufs[i];
+	return b;
+}
+
+/* Start drawing a frame into a buffer, after every drw_damage of the frame.
+ * The buffers are reused, so each holds what it showed when last drawn:
+ * only what changed since then is stale in it.  If the compositor holds
+ * every buffer, wait until it releases one. */
+void
+drw_begin(Drw *drw)
+{
+	DrwBuf *b;
+	size_t i;
+
+	for (i = 0; i < DRW_BUFS; i++)
+		pixman_region32_union(&drw->bufs[i].stale, &drw->bufs[i].stale, &drw->damage);
+	if (drw->queue)
+		wl_display_dispatch_queue_pending(drw->dpy, drw->queue);
+	while (!(b = idlebuf(drw))) {
+		drw->waits++;
+		if (wl_display_dispatch_queue(drw->dpy, drw->queue) < 0)
+			die("cannot wait for a buffer");
+	}
+	if (!b->wl || b->w != drw->w || b->h != drw->h)
+		allocbuf(drw, b);
+	b->drawn = ++drw->frames;
+	drw->back = b;
+	wld_set_target_buffer(drw->renderer, b->buffer);
+}
+
+/* return whether a rectangle has to be drawn in the back buffer */
+int
+drw_stale(Drw *drw, int x, int y, unsigned int w, unsigned int h)
+{
+	pixman_box32_t box = { x, y, x + w, y + h };
+
+	return drw->back && w && h &&
+	       pixman_region32_contains_rectangle(&drw->back->stale, &box) != PIXMAN_REGION_OUT;
+}
+
+/* show the back buffer, telling the compositor what changed; without a
+ * surface the frame is only kept for drw_dump */
+void
+drw_map(Drw *drw, struct wl_surface *surface)
+{
+	pixman_box32_t *box;
+	int n;
+
+	if (!drw || !drw->back)
 		return;
 
-	wl_surface_damage(surface, x, y, w, h);
 	wld_flush(drw->renderer);
-	wld_swap(drw->surface);
+	if (surface && drw->back->wl) {
+		wl_surface_attach(surface, drw->back->wl, 0, 0);
+		for (box = pixman_region32_rectangles(&drw->damage, &n); n > 0; n--, box++)
+			wl_surface_damage(surface, box->x1, box->y1, box->x2 - box->x1, box->y2 - box->y1);
+		wl_surface_commit(surface);
+		drw->back->busy = 1;
+	}
+	drw->shown = drw->back;
+	pixman_region32_clear(&drw->back->stale);
+	pixman_region32_clear(&drw->damage);
+	drw->back = NULL;
+}
+
+/* write the frame mapped last to fp as a binary PPM image */
+int
+drw_dump(Drw *drw, FILE *fp)
+{
+	const uint32_t *row;
+	unsigned int x, y;
+
+	if (!drw || !drw->shown)
+		return -1;
+	fprintf(fp, "P6\n%u %u\n255\n", drw->shown->w, drw->shown->h);
+	for (y = 0; y < drw->shown->h; y++) {
+		row = (const uint32_t *)((const char *)drw->shown->data + (size_t)y * drw->shown->buffer->pitch);
+		for (x = 0; x < drw->shown->w; x++) {
+			putc(row[x] >> 16 & 0xff, fp);
+			putc(row[x] >> 8 & 0xff, fp);
+			putc(row[x] & 0xff, fp);
+		}
+	}
+	return ferror(fp) ? -1 : 0;
 }
 
 unsigned int
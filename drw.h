@@ -3,28 +3,67 @@
 typedef void Cur;
 
 typedef struct Fnt {
-	struct wld_font *wld;
+	const char *name; /* it is opened from, NULL if it cannot be */
+	struct wld_font *wld; /* NULL until first needed */
 	FcPattern *pattern;
 	struct Fnt *next;
 } Fnt;
 
+typedef struct {
+	uint32_t rune; /* plus one, 0 for a free entry */
+	Fnt *font; /* drawing it, NULL if none has it */
+} FntRune;
+
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef uint32_t Clr;
 
+#define DRW_BUFS 3 /* shared memory buffers a surface may have in flight */
+
+typedef struct {
+	struct wl_buffer *wl;
+	struct wld_buffer *buffer; /* drawing into the same memory */
+	void *data;
+	unsigned int w, h;
+	int busy; /* attached until the compositor releases it */
+	unsigned long drawn; /* frame last drawn into it */
+	pixman_region32_t stale; /* changed since it was drawn */
+} DrwBuf;
+
+typedef struct {
+	uint64_t key; /* names the text and colors, with w and h */
+	unsigned int w, h;
+	struct wld_buffer *buffer; /* the text rendered */
+	unsigned long used; /* when last drawn, for evicting */
+} DrwRow;
+
 typedef struct {
 	unsigned int w, h;
 	struct wl_display *dpy;
+	struct wl_shm *shm;
+	struct wl_event_queue *queue; /* of the buffer releases */
 	struct wld_context *ctx;
 	struct wld_renderer *renderer;
-	struct wld_surface *surface;
 	struct wld_font_context *fontctx;
 	Clr *scheme;
 	Fnt *fonts;
+	const char *fontcache; /* file of what font names matched, or NULL */
+	FntRune *runes; /* open addressing table of the runes drawn */
+	size_t runesize, nrunes;
+	pixman_region32_t damage; /* changed since the last frame */
+	DrwBuf bufs[DRW_BUFS];
+	DrwBuf *back; /* the buffer drawn into, NULL between frames */
+	DrwBuf *shown; /* the buffer mapped last */
+	unsigned long frames;
+	unsigned long allocs, waits; /* buffers allocated, and waited for */
+	DrwRow *rows; /* text kept rendered, least recently used evicted */
+	size_t nrows, rowcap;
+	size_t rowbytes, rowbudget; /* bytes of the rows, and at most */
+	unsigned long rowclock;
 } Drw;
 
 /* Drawable abstraction */
-Drw *drw_create(struct wl_display *dpy);
-void drw_resize(Drw *drw, struct wl_surface *surface, unsigned int w, unsigned int h);
+Drw *drw_create(struct wl_display *dpy, struct wl_shm *shm);
+void drw_resize(Drw *drw, unsigned int w, unsigned int h);
 void drw_free(Drw *drw);
 
 /* Fnt abstraction */
@@ -48,6 +87,14 @@ void drw_setscheme(Drw *drw, Clr *scm);
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
+void drw_text_cached(Drw *drw, uint64_t key, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
+void drw_rows_forget(Drw *drw);
+
+/* Damage functions */
+void drw_damage(Drw *drw, int x, int y, unsigned int w, unsigned int h);
+void drw_begin(Drw *drw);
+int drw_stale(Drw *drw, int x, int y, unsigned int w, unsigned int h);
 
 /* Map functions */
-void drw_map(Drw *drw, struct wl_surface *surface, int x, int y, unsigned int w, unsigned int h);
+void drw_map(Drw *drw, struct wl_surface *surface);
+int drw_dump(Drw *drw, FILE *fp);
@@ -0,0 +1,8 @@
+/* See LICENSE file for copyright and license details. */
+
+/* bytes needed to fold n bytes, a 2-byte sequence may fold to 3 bytes */
+#define FOLDSIZE(N) ((N) / 2 * 3 + (N) % 2)
+
+/* Write the Unicode simple case folding of the UTF-8 text src of len bytes
+ * to dst and return its length.  Invalid sequences are copied unchanged. */
+size_t utf8fold(char *dst, const char *src, size_t len);
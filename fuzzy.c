@@ -0,0 +1,132 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <string.h>
+
+#include "fuzzy.h"
+#include "util.h"
+
+#define SCOREMATCH     16  /* for every character matched */
+#define BONUSBOUNDARY  8   /* at the start or after a delimiter, twice for
+                            * the first character */
+#define BONUSCAMEL     7   /* at a lower to upper case or a digit change */
+#define BONUSCONSEC    4   /* right after the previous character */
+#define BONUSCASE      1   /* in the same case as the query */
+#define PENALTYGAP     3   /* for every gap between characters */
+#define PENALTYEXT     1   /* for every byte a gap is longer than one */
+
+#define ISUPPER(C)     BETWEEN((unsigned char)(C), 'A', 'Z')
+#define ISLOWER(C)     BETWEEN((unsigned char)(C), 'a', 'z')
+#define ISDIGIT(C)     BETWEEN((unsigned char)(C), '0', '9')
+#define ISCONT(C)      (((unsigned char)(C) & 0xC0) == 0x80)
+#define LOWER(C)       (ISUPPER(C) ? (unsigned char)(C) | 0x20 : (unsigned char)(C))
+
+static const char delimiters[] = " /\\-_.:,;|";
+
+static int
+charbit(unsigned char c)
+{
+	c = LOWER(c);
+	if (ISLOWER(c))
+		return c - 'a';
+	if (ISDIGIT(c))
+		return 26 + c - '0';
+	return 36 + c % 28;
+}
+
+uint64_t
+fuzzymask(const char *s, size_t len)
+{
+	uint64_t mask = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		mask |= (uint64_t)1 << charbit(s[i]);
+	return mask;
+}
+
+/* return the length of the character of q at j, with the continuation bytes
+ * after it */
+static size_t
+charlen(const char *q, size_t qlen, size_t j)
+{
+	size_t n;
+
+	for (n = 1; j + n < qlen && ISCONT(q[j + n]); n++)
+		;
+	return n;
+}
+
+/* return whether the character c of n bytes is at s[i] */
+static int
+charat(const char *s, size_t len, size_t i, const char *c, size_t n)
+{
+	if (n == 1)
+		return LOWER(s[i]) == LOWER(*c);
+	return n <= len - i && !memcmp(s + i, c, n);
+}
+
+static int
+bonus(const char *s, size_t i)
+{
+	unsigned char p, c = s[i];
+
+	if (i == 0)
+		return BONUSBOUNDARY;
+	p = s[i - 1];
+	if (p && strchr(delimiters, p))
+		return BONUSBOUNDARY;
+	if ((ISLOWER(p) && ISUPPER(c)) || (ISDIGIT(p) != ISDIGIT(c) && !ISCONT(c)))
+		return BONUSCAMEL;
+	return 0;
+}
+
+/* The query is matched forward to the first place it ends, then backward
+ * from there to the last place it starts, and only that shortest window is
+ * scored. */
+int
+fuzzyscore(const char *s, size_t len, const char *q, size_t qlen, int *score)
+{
+	size_t i, j, k, n, start, end, last;
+	unsigned char c;
+	int b, sc = 0;
+
+	for (i = j = 0; i < len && j < qlen; i++) {
+		if ((n = charlen(q, qlen, j)) == 1) {
+			for (c = LOWER(q[j]); i < len && LOWER(s[i]) != c; i++)
+				;
+			if (i == len)
+				return 0;
+		} else if (!charat(s, len, i, q + j, n)) {
+			continue;
+		}
+		i += n - 1;
+		j += n;
+	}
+	if (j < qlen)
+		return 0;
+	for (end = i; j > 0; j = k) {
+		for (k = j - 1; k > 0 && ISCONT(q[k]); k--)
+			;
+		while (!charat(s, end, --i, q + k, j - k))
+			;
+	}
+	start = i;
+
+	for (i = start, last = start; j < qlen; i++) {
+		if (!charat(s, end, i, q + j, n = charlen(q, qlen, j)))
+			continue;
+		b = bonus(s, i);
+		sc += SCOREMATCH + (j ? b : 2 * b);
+		if (j && i == last)
+			sc += BONUSCONSEC;
+		else if (j)
+			sc -= PENALTYGAP + (int)(i - last - 1) * PENALTYEXT;
+		if (n == 1 && s[i] == q[j])
+			sc += BONUSCASE;
+		last = i + n;
+		i += n - 1;
+		j += n;
+	}
+	*score = sc;
+	return 1;
+}
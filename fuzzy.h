@@ -0,0 +1,9 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Return the set of bytes in s as a mask, ASCII letters in either case.  An
+ * item can only match a query whose mask is a subset of its own. */
+uint64_t fuzzymask(const char *s, size_t len);
+
+/* If the characters of q occur in s in order, set *score to how well they
+ * do and return 1, else return 0.  ASCII letters match in either case. */
+int fuzzyscore(const char *s, size_t len, const char *q, size_t qlen, int *score);
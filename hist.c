@@ -0,0 +1,172 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "util.h"
+
+#define HISTMIN  1024 /* entries in a new table */
+#define DAY      (24 * 60 * 60)
+#define MAPSIZE(N) (sizeof(HistHeader) + (size_t)(N) * sizeof(HistEntry))
+
+static uint64_t
+hash(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	/* FNV-1a, with 0 left for free entries */
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+	return h ? h : 1;
+}
+
+/* return the entry of the hash h, or the free one it would go in, or NULL
+ * if neither is in the table */
+static HistEntry *
+lookup(const History *hist, uint64_t h)
+{
+	size_t i, n, mask = hist->size - 1;
+
+	for (i = h & mask, n = 0; n < hist->size; i = (i + 1) & mask, n++)
+		if (!hist->tab[i].hash || hist->tab[i].hash == h)
+			return &hist->tab[i];
+	return NULL;
+}
+
+static void
+map(History *hist, size_t size)
+{
+	if ((hist->h = mmap(NULL, MAPSIZE(size), PROT_READ | PROT_WRITE, MAP_SHARED, hist->fd, 0)) == MAP_FAILED)
+		die("cannot mmap '%s':", hist->file);
+	hist->tab = (HistEntry *)(hist->h + 1);
+	hist->size = size;
+}
+
+/* map the file again, as another dmenu may have grown it; called locked */
+static void
+remap(History *hist)
+{
+	struct stat st;
+
+	if (fstat(hist->fd, &st) < 0)
+		die("cannot stat '%s':", hist->file);
+	if (hist->h) {
+		if ((size_t)st.st_size == MAPSIZE(hist->size))
+			return;
+		munmap(hist->h, MAPSIZE(hist->size));
+	}
+	if (st.st_size == 0) {
+		if (ftruncate(hist->fd, MAPSIZE(HISTMIN)) < 0)
+			die("cannot grow '%s':", hist->file);
+		map(hist, HISTMIN);
+		memcpy(hist->h->magic, HISTMAGIC, sizeof hist->h->magic);
+		hist->h->version = HISTVERSION;
+		hist->h->size = HISTMIN;
+		return;
+	}
+	if ((size_t)st.st_size < sizeof(HistHeader) ||
+	    ((size_t)st.st_size - sizeof(HistHeader)) % sizeof(HistEntry))
+		die("%s: not a dmenu history", hist->file);
+	map(hist, ((size_t)st.st_size - sizeof(HistHeader)) / sizeof(HistEntry));
+	if (memcmp(hist->h->magic, HISTMAGIC, sizeof hist->h->magic) ||
+	    hist->h->version != HISTVERSION || hist->h->size != hist->size ||
+	    !hist->size || (hist->size & (hist->size - 1)) || hist->h->used >= hist->size)
+		die("%s: not a dmenu history", hist->file);
+}
+
+/* map the history file, creating it if there is none */
+void
+hist_open(History *hist, const char *file)
+{
+	hist->file = file;
+	if ((hist->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+	    flock(hist->fd, LOCK_EX) < 0)
+		die("cannot open '%s':", file);
+	remap(hist);
+	flock(hist->fd, LOCK_UN);
+}
+
+/* lock the history for reading, mapping it again if another dmenu grew it */
+void
+hist_lock(History *hist)
+{
+	if (!hist->h)
+		return;
+	flock(hist->fd, LOCK_SH);
+	remap(hist);
+}
+
+void
+hist_unlock(History *hist)
+{
+	if (hist->h)
+		flock(hist->fd, LOCK_UN);
+}
+
+/* return how often and how recently the item s was selected, 0 if never;
+ * called between hist_lock and hist_unlock */
+unsigned int
+hist_frecency(const History *hist, const char *s, size_t len, time_t now)
+{
+	const HistEntry *e;
+	time_t age;
+
+	if (!hist->h || !(e = lookup(hist, hash(s, len))) || !e->hash)
+		return 0;
+	age = now - e->last;
+	if (age < 4 * DAY)
+		return e->count * 100;
+	if (age < 14 * DAY)
+		return e->count * 70;
+	if (age < 31 * DAY)
+		return e->count * 50;
+	if (age < 90 * DAY)
+		return e->count * 30;
+	return e->count * 10;
+}
+
+/* record that the item s was selected now */
+void
+hist_add(History *hist, const char *s, size_t len, time_t now)
+{
+	HistEntry *old, *e;
+	size_t i, size;
+
+	if (!hist->h)
+		return;
+	flock(hist->fd, LOCK_EX);
+	remap(hist);
+	if (2 * (hist->h->used + 1) > hist->size) {
+		/* rehash into a table twice the size */
+		size = hist->size;
+		old = ecalloc(size, sizeof *old);
+		memcpy(old, hist->tab, size * sizeof *old);
+		munmap(hist->h, MAPSIZE(size));
+		if (ftruncate(hist->fd, MAPSIZE(2 * size)) < 0)
+			die("cannot grow '%s':", hist->file);
+		map(hist, 2 * size);
+		hist->h->size = 2 * size;
+		memset(hist->tab, 0, 2 * size * sizeof *hist->tab);
+		for (i = 0; i < size; i++)
+			if (old[i].hash)
+				*lookup(hist, old[i].hash) = old[i];
+		free(old);
+	}
+	if ((e = lookup(hist, hash(s, len)))) {
+		if (!e->hash) {
+			e->hash = hash(s, len);
+			hist->h->used++;
+		}
+		e->count++;
+		e->last = now;
+	}
+	flock(hist->fd, LOCK_UN);
+}
@@ -0,0 +1,37 @@
+/* See LICENSE file for copyright and license details. */
+
+#define HISTMAGIC   "dmenuhst"
+#define HISTVERSION 1
+
+/* Layout of a history file: the header is followed by an open addressing
+ * hash table of size entries, keyed by a hash of the item text.  All
+ * integers are in native byte order. */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t size; /* entries in the table, a power of two */
+	uint32_t used;
+	uint32_t pad;
+} HistHeader;
+
+typedef struct {
+	uint64_t hash; /* of the item text, 0 for a free entry */
+	uint32_t count; /* times the item was selected */
+	uint32_t pad;
+	int64_t last; /* time it was selected last */
+} HistEntry;
+
+typedef struct {
+	const char *file;
+	int fd;
+	HistHeader *h; /* the mapped file */
+	HistEntry *tab;
+	size_t size; /* entries mapped, which another dmenu may have grown */
+} History;
+
+/* History abstraction */
+void hist_open(History *hist, const char *file);
+void hist_lock(History *hist);
+void hist_unlock(History *hist);
+unsigned int hist_frecency(const History *hist, const char *s, size_t len, time_t now);
+void hist_add(History *hist, const char *s, size_t len, time_t now);
@@ -0,0 +1,28 @@
+/* See LICENSE file for copyright and license details. */
+
+#define IDXMAGIC   "dmenuidx"
+#define IDXVERSION 3
+
+/* Layout of an item index as written by dmenu_index. Section offsets are
+ * from the start of the file and all integers are in native byte order. */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t nitems;
+	uint64_t text, textsize; /* NUL-terminated item texts */
+	uint64_t keys, keysize;  /* NUL-terminated texts with simple case folding */
+	uint64_t textoff;        /* uint32_t[nitems] text offsets in text */
+	uint64_t textlen;        /* uint32_t[nitems] text lengths */
+	uint64_t keyoff;         /* uint32_t[nitems] key offsets in keys */
+	uint64_t keylen;         /* uint32_t[nitems] key lengths */
+	uint64_t widths;         /* uint32_t[nitems] text widths, or 0 */
+	uint64_t grams, ngrams;  /* IdxGram[ngrams] trigrams of the keys, or 0 */
+	uint64_t postings, postingsize; /* their posting lists */
+	char fonts[256];         /* newline-separated fonts the widths are for */
+} IdxHeader;
+
+typedef struct {
+	uint32_t gram, n; /* trigram and number of items holding it */
+	uint32_t len, pad; /* bytes of its posting list */
+	uint64_t off; /* offset of its posting list in postings */
+} IdxGram;
@@ -0,0 +1,123 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <string.h>
+
+#include "search.h"
+
+char *
+memfind(const char *s, size_t len, const char *sub, size_t sublen)
+{
+	const char *p, *end;
+
+	if (!sublen)
+		return (char *)s;
+	if (sublen > len)
+		return NULL;
+	for (p = s, end = s + len - sublen + 1; (p = memchr(p, sub[0], end - p)); p++)
+		if (!memcmp(p + 1, sub + 1, sublen - 1))
+			return (char *)p;
+	return NULL;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+/* A position can only start a match if both its byte and the byte sublen - 1
+ * further on equal the first and last byte of sub, so a block of positions
+ * is tested at once and only the candidates left are compared in full.  The
+ * last block is moved back to end with the string, so nothing past it is
+ * read, and strings shorter than a block are left to memchr. */
+
+__attribute__((target("sse2")))
+static char *
+find128(const char *s, size_t len, const char *sub, size_t sublen)
+{
+	const char *p;
+	__m128i first, last, a, b;
+	unsigned int mask;
+	size_t i;
+	int j;
+
+	if (!sublen || sublen > len)
+		return sublen ? NULL : (char *)s;
+	first = _mm_set1_epi8(sub[0]);
+	last = _mm_set1_epi8(sub[sublen - 1]);
+	for (i = 0; i + sublen <= len; i += 16) {
+		p = s + i;
+		mask = 0xFFFF;
+		if (i + sublen - 1 + 16 > len) {
+			if (i > 0) {
+				/* step back and skip the positions already tested */
+				p = s + len - sublen + 1 - 16;
+				mask <<= s + i - p;
+				i = p - s;
+			} else {
+				/* too short for a block, memchr does well on those */
+				return memfind(s, len, sub, sublen);
+			}
+		}
+		a = _mm_loadu_si128((const __m128i *)p);
+		b = _mm_loadu_si128((const __m128i *)(p + sublen - 1));
+		mask &= _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			j = __builtin_ctz(mask);
+			if (!memcmp(p + j + 1, sub + 1, sublen - 1))
+				return (char *)s + i + j;
+		}
+	}
+	return NULL;
+}
+
+__attribute__((target("avx2")))
+static char *
+find256(const char *s, size_t len, const char *sub, size_t sublen)
+{
+	const char *p;
+	__m256i first, last, a, b;
+	unsigned int mask;
+	size_t i;
+	int j;
+
+	if (!sublen || sublen > len)
+		return sublen ? NULL : (char *)s;
+	first = _mm256_set1_epi8(sub[0]);
+	last = _mm256_set1_epi8(sub[sublen - 1]);
+	for (i = 0; i + sublen <= len; i += 32) {
+		p = s + i;
+		mask = 0xFFFFFFFF;
+		if (i + sublen - 1 + 32 > len) {
+			if (i > 0) {
+				/* step back and skip the positions already tested */
+				p = s + len - sublen + 1 - 32;
+				mask <<= s + i - p;
+				i = p - s;
+			} else {
+				/* too short for a block, memchr does well on those */
+				return memfind(s, len, sub, sublen);
+			}
+		}
+		a = _mm256_loadu_si256((const __m256i *)p);
+		b = _mm256_loadu_si256((const __m256i *)(p + sublen - 1));
+		mask &= _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			j = __builtin_ctz(mask);
+			if (!memcmp(p + j + 1, sub + 1, sublen - 1))
+				return (char *)s + i + j;
+		}
+	}
+	return NULL;
+}
+#endif
+
+Findfn
+findfn(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return find256;
+	if (__builtin_cpu_supports("sse2"))
+		return find128;
+#endif
+	return memfind;
+}
@@ -0,0 +1,9 @@
+/* See LICENSE file for copyright and license details. */
+
+typedef char *(*Findfn)(const char *s, size_t len, const char *sub, size_t sublen);
+
+/* portable substring search */
+char *memfind(const char *s, size_t len, const char *sub, size_t sublen);
+
+/* return the fastest substring search this cpu can run */
+Findfn findfn(void);
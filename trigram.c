@@ -0,0 +1,215 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fold.h"
+#include "trigram.h"
+#include "util.h"
+
+#define GRAM(P)    ((uint32_t)(unsigned char)(P)[0] | (uint32_t)(unsigned char)(P)[1] << 8 | \
+                    (uint32_t)(unsigned char)(P)[2] << 16)
+#define HASH(G)    ((G) * 2654435761U)
+#define LISTRATIO  8 /* longest list worth intersecting, per candidate */
+
+static Posting *
+lookup(const Trigrams *t, uint32_t gram)
+{
+	size_t i, mask;
+
+	if (!t->size)
+		return NULL;
+	for (i = HASH(gram) & (mask = t->size - 1); t->tab[i].n; i = (i + 1) & mask)
+		if (t->tab[i].gram == gram)
+			return &t->tab[i];
+	return &t->tab[i];
+}
+
+static Posting *
+intern(Trigrams *t, uint32_t gram)
+{
+	Posting *old = t->tab, *p;
+	size_t i, oldsize = t->size;
+
+	if (2 * (t->used + 1) > t->size) {
+		t->size = t->size ? t->size * 2 : 4096;
+		t->tab = ecalloc(t->size, sizeof *t->tab);
+		for (i = 0; i < oldsize; i++)
+			if (old[i].n)
+				*lookup(t, old[i].gram) = old[i];
+		free(old);
+	}
+	if (!(p = lookup(t, gram))->n) {
+		p->gram = gram;
+		t->used++;
+	}
+	return p;
+}
+
+static void
+putvarint(Posting *p, uint32_t v)
+{
+	if (p->len + 5 > p->size) {
+		p->size = p->size ? p->size * 2 : 16;
+		if (!(p->data = realloc(p->data, p->size)))
+			die("cannot realloc %u bytes:", p->size);
+	}
+	for (; v >= 0x80; v >>= 7)
+		p->data[p->len++] = v | 0x80;
+	p->data[p->len++] = v;
+}
+
+static const unsigned char *
+getvarint(const unsigned char *s, const unsigned char *end, uint32_t *v)
+{
+	int shift;
+
+	for (*v = 0, shift = 0; s < end && *s & 0x80; s++, shift += 7)
+		*v |= (uint32_t)(*s & 0x7F) << (shift & 31);
+	if (s < end)
+		*v |= (uint32_t)*s++ << (shift & 31);
+	return s;
+}
+
+/* fold s into the scratch buffer */
+static size_t
+fold(Trigrams *t, const char *s, size_t len)
+{
+	if (FOLDSIZE(len) > t->bufsize) {
+		t->bufsize = MAX(t->bufsize * 2, FOLDSIZE(len));
+		if (!(t->buf = realloc(t->buf, t->bufsize)))
+			die("cannot realloc %zu bytes:", t->bufsize);
+	}
+	return utf8fold(t->buf, s, len);
+}
+
+/* Cut the bytes off either end of s which may belong to a character that
+ * begins before it or ends after it: they fold differently within the item. */
+static void
+trim(const char **s, size_t *len)
+{
+	const unsigned char *p = (const unsigned char *)*s, *end = p + *len, *q;
+	size_t n;
+
+	for (n = 0; p < end && n < 3 && (*p & 0xC0) == 0x80; n++)
+		p++;
+	for (q = end, n = 0; q > p && n < 3 && (q[-1] & 0xC0) == 0x80; n++)
+		q--;
+	if (q > p && q[-1] >= 0xC0 && (size_t)(end - q) + 1 <
+	    (q[-1] >= 0xF0 ? 4U : q[-1] >= 0xE0 ? 3U : 2U))
+		end = q - 1;
+	*s = (const char *)p;
+	*len = end > p ? end - p : 0;
+}
+
+/* add the trigrams of an item, items must be added in ascending order */
+void
+tri_add(Trigrams *t, uint32_t item, const char *s, size_t len)
+{
+	Posting *p;
+	size_t i;
+
+	len = fold(t, s, len);
+	for (i = 0; i + 3 <= len; i++) {
+		p = intern(t, GRAM(t->buf + i));
+		if (p->n && p->last == item)
+			continue; /* already seen in this item */
+		putvarint(p, p->n ? item - p->last : item);
+		p->last = item;
+		p->n++;
+	}
+}
+
+/* add a posting list stored elsewhere, which is used in place */
+void
+tri_insert(Trigrams *t, uint32_t gram, uint32_t n, const unsigned char *data, uint32_t len)
+{
+	Posting *p = intern(t, gram);
+
+	p->n = n;
+	p->len = len;
+	p->size = 0;
+	p->data = (unsigned char *)data;
+}
+
+/* order by length, keeping lists which are the same together */
+static int
+cmpn(const void *a, const void *b)
+{
+	const Posting *x = *(Posting *const *)a, *y = *(Posting *const *)b;
+
+	if (x->n != y->n)
+		return (x->n > y->n) - (x->n < y->n);
+	return (x > y) - (x < y);
+}
+
+/* Set *cand to the items from index from on which hold every trigram of the
+ * tokens, in ascending order, and return how many there are.  They are only
+ * candidates: the tokens still have to be searched in them.  If no token is
+ * long enough to have trigrams, return TRI_ALL. */
+size_t
+tri_query(Trigrams *t, char *const *tokv, const size_t *toklen, int tokc,
+          uint32_t from, uint32_t **cand)
+{
+	const unsigned char *s, *end;
+	const char *tok;
+	size_t i, k, m, n, ncand, nlists = 0;
+	uint32_t item, delta;
+	Posting *p;
+	int j;
+
+	for (j = 0; j < tokc; j++) {
+		tok = tokv[j];
+		n = toklen[j];
+		trim(&tok, &n);
+		n = fold(t, tok, n);
+		for (i = 0; i + 3 <= n; i++) {
+			if (!(p = lookup(t, GRAM(t->buf + i))) || !p->n)
+				return 0; /* no item holds this trigram */
+			if (nlists == t->listsize) {
+				t->listsize = t->listsize ? t->listsize * 2 : 64;
+				if (!(t->lists = realloc(t->lists, t->listsize * sizeof *t->lists)))
+					die("cannot realloc %zu bytes:", t->listsize * sizeof *t->lists);
+			}
+			t->lists[nlists++] = p;
+		}
+	}
+	if (!nlists)
+		return TRI_ALL;
+	qsort(t->lists, nlists, sizeof *t->lists, cmpn);
+
+	/* start from the shortest list */
+	p = t->lists[0];
+	if (p->n > t->candsize) {
+		t->candsize = p->n;
+		if (!(t->cand = realloc(t->cand, t->candsize * sizeof *t->cand)))
+			die("cannot realloc %zu bytes:", t->candsize * sizeof *t->cand);
+	}
+	for (s = p->data, end = s + p->len, ncand = 0, item = 0, i = 0; i < p->n && s < end; i++) {
+		s = getvarint(s, end, &delta);
+		item = i ? item + delta : delta;
+		if (item >= from)
+			t->cand[ncand++] = item;
+	}
+	/* intersect it with the others while they are short enough to be
+	 * cheaper than searching the tokens in the candidates */
+	for (j = 1; j < (int)nlists && ncand; j++) {
+		if ((p = t->lists[j]) == t->lists[j - 1])
+			continue;
+		if (p->n > LISTRATIO * ncand)
+			break;
+		s = p->data;
+		end = s + p->len;
+		for (i = k = m = 0, item = 0; i < p->n && s < end && k < ncand; i++) {
+			s = getvarint(s, end, &delta);
+			item = i ? item + delta : delta;
+			while (k < ncand && t->cand[k] < item)
+				k++;
+			if (k < ncand && t->cand[k] == item)
+				t->cand[m++] = t->cand[k++];
+		}
+		ncand = m;
+	}
+	*cand = t->cand;
+	return ncand;
+}
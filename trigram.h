@@ -0,0 +1,29 @@
+/* See LICENSE file for copyright and license details. */
+
+typedef struct {
+	uint32_t gram; /* three bytes of case-folded text */
+	uint32_t n;    /* number of items holding it, 0 for a free slot */
+	uint32_t last; /* last item added */
+	uint32_t len, size; /* bytes of data used and allocated, size is 0 if
+	                     * data is not ours */
+	unsigned char *data; /* item indices as varint deltas */
+} Posting;
+
+typedef struct {
+	Posting *tab; /* open addressing hash table */
+	size_t size, used;
+	char *buf; /* folded text */
+	size_t bufsize;
+	Posting **lists; /* lists of the trigrams in a query */
+	size_t listsize;
+	uint32_t *cand; /* items found by a query */
+	size_t candsize;
+} Trigrams;
+
+#define TRI_ALL ((size_t)-1)
+
+/* Trigram abstraction */
+void tri_add(Trigrams *t, uint32_t item, const char *s, size_t len);
+void tri_insert(Trigrams *t, uint32_t gram, uint32_t n, const unsigned char *data, uint32_t len);
+size_t tri_query(Trigrams *t, char *const *tokv, const size_t *toklen, int tokc,
+                 uint32_t from, uint32_t **cand);